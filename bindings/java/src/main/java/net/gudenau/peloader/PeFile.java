@@ -7,6 +7,7 @@ import org.jetbrains.annotations.NotNull;
 import java.lang.foreign.Arena;
 import java.lang.foreign.FunctionDescriptor;
 import java.lang.invoke.MethodHandle;
+import java.util.List;
 import java.util.SequencedCollection;
 
 /**
@@ -29,6 +30,14 @@ public sealed interface PeFile extends AutoCloseable permits PeFileImpl {
      */
     void export(@NotNull PeSymbol symbol);
 
+    /**
+     * Gets many exported symbols from the PE file with a single native call.
+     *
+     * @param symbols The symbols to get
+     * @throws UnsatisfiedLinkError If any of the symbols could not be found, all misses are listed
+     */
+    void export(@NotNull List<@NotNull PeSymbol> symbols);
+
     /**
      * Downcalls an exported symbol from the PE file.
      *
@@ -66,6 +66,15 @@ public final class Natives {
         }
     }
 
+    private static final MethodHandle peloader_exportMany;
+    public static int peloader_exportMany(@NotNull MemorySegment file, @NotNull MemorySegment symbols, int count, @NotNull MemorySegment failedIndex) {
+        try {
+            return (int) peloader_exportMany.invokeExact(file, symbols, count, failedIndex);
+        } catch(Throwable e) {
+            throw new RuntimeException("Failed to invoke peloader_exportMany", e);
+        }
+    }
+
     private static final MethodHandle peloader_modules;
     public static int peloader_modules(@NotNull MemorySegment file, @NotNull MemorySegment names) {
         try {
@@ -141,6 +150,7 @@ public final class Natives {
         peloader_close = binder.bind("close", null, ADDRESS);
         peloader_import = binder.bind("import", JAVA_INT, ADDRESS, ADDRESS, ADDRESS);
         peloader_export = binder.bind("export", JAVA_INT, ADDRESS, ADDRESS);
+        peloader_exportMany = binder.bind("exportMany", JAVA_INT, ADDRESS, ADDRESS, JAVA_INT, ADDRESS);
         peloader_modules = binder.bind("modules", JAVA_INT, ADDRESS, ADDRESS);
         peloader_imports = binder.bind("imports", JAVA_INT, ADDRESS, ADDRESS, ADDRESS);
         peloader_exports = binder.bind("exports", JAVA_INT, ADDRESS, ADDRESS);
@@ -17,6 +17,7 @@ import java.util.SequencedCollection;
 import java.util.function.Function;
 
 import static java.lang.foreign.ValueLayout.ADDRESS;
+import static java.lang.foreign.ValueLayout.JAVA_INT;
 
 public record PeFileImpl(
     @NotNull MemorySegment pointer
@@ -37,6 +38,40 @@ public record PeFileImpl(
         }
     }
 
+    @Override
+    public void export(@NotNull List<@NotNull PeSymbol> symbols) {
+        if(symbols.isEmpty()) {
+            return;
+        }
+
+        var layout = Natives.PE_SYMBOL_LAYOUT;
+        var layoutSize = layout.byteSize();
+        var count = symbols.size();
+        try(var arena = Arena.ofConfined()) {
+            var array = arena.allocate(layout, count);
+            for(int i = 0; i < count; i++) {
+                array.asSlice(layoutSize * i, layoutSize).copyFrom(symbols.get(i).segment());
+            }
+
+            var result = Natives.peloader_exportMany(pointer, array, count, arena.allocate(JAVA_INT));
+            if(result < 0) {
+                throw new UnsatisfiedLinkError("Failed to bind exports");
+            }
+
+            var missing = new ArrayList<String>(result);
+            for(int i = 0; i < count; i++) {
+                var symbol = symbols.get(i);
+                symbol.segment().copyFrom(array.asSlice(layoutSize * i, layoutSize));
+                if(symbol.address().equals(MemorySegment.NULL)) {
+                    missing.add(symbol.identifier());
+                }
+            }
+            if(!missing.isEmpty()) {
+                throw new UnsatisfiedLinkError("Failed to bind exports " + String.join(", ", missing));
+            }
+        }
+    }
+
     @Nullable
     private static <T> SequencedCollection<@NotNull T> getList(
         @NotNull Function<MemorySegment, Integer> getter,
@@ -0,0 +1,19 @@
+#ifndef PELOADER_CACHE_H
+#define PELOADER_CACHE_H
+
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include "internal.h"
+
+int loadCachedImage(PeFile* file, const char* directory, const struct stat64& stat, uint64_t* relocateFrom);
+int storeCachedImage(PeFile* file, const char* directory);
+int writeImageEntry(PeFile* file, int handle, uint64_t* imageOffset);
+int mapImageEntry(PeFile* file, int handle, uint64_t* imageOffset, uint64_t* relocateFrom);
+int openWorkingSet(PeFile* file, const char* directory, const struct stat64& stat);
+int loadWorkingSet(const PeWorkingSet* workingSet, uint8_t* pages, size_t pageCount);
+int storeWorkingSet(const PeWorkingSet* workingSet, const uint8_t* pages, size_t pageCount);
+void freeWorkingSet(PeFile* file);
+
+#endif //PELOADER_CACHE_H
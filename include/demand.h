@@ -0,0 +1,9 @@
+#ifndef PELOADER_DEMAND_H
+#define PELOADER_DEMAND_H
+
+#include "internal.h"
+
+int startDemandPaging(PeFile* file);
+void stopDemandPaging(PeFile* file);
+
+#endif //PELOADER_DEMAND_H
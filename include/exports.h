@@ -0,0 +1,15 @@
+#ifndef PELOADER_EXPORTS_H
+#define PELOADER_EXPORTS_H
+
+#include <cstdint>
+
+#include "internal.h"
+
+uint32_t exportIndexCapacity(uint32_t nameCount);
+int buildExportIndex(PeFile* file, PeExportIndexEntry* entries);
+int64_t findExportSlot(PeFile* file, const char* name);
+int64_t findOrdinalSlot(PeFile* file, int ordinal);
+void findExportSlots(PeFile* file, const PeSymbol* symbols, int count, int64_t* slots);
+void* exportAddress(PeFile* file, uint32_t slot);
+
+#endif //PELOADER_EXPORTS_H
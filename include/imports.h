@@ -0,0 +1,15 @@
+#ifndef PELOADER_IMPORTS_H
+#define PELOADER_IMPORTS_H
+
+#include "internal.h"
+
+PE_FUNC void unboundImport();
+
+int importOrdinalIndexSize(int count, int low, int high);
+void buildImportOrdinalIndex(PeImportModule* module, PeImportOrdinal* ordinals);
+PeImportedFunction* findImportOrdinal(PeImportModule* module, int ordinal);
+int bindImports(PeFile* file, const PeLoaderOpen* options);
+int storeImport(PeFile* file, void** slot, void* address);
+int exchangeImport(PeFile* file, void** slot, void** expected, void* address);
+
+#endif //PELOADER_IMPORTS_H
@@ -10,20 +10,118 @@ typedef struct {
     int ordinal;
 } PeImportedFunction;
 
+/**
+ * Maps an imported ordinal to the function that imports it.
+ */
+typedef struct {
+    int ordinal;
+    int index;
+} PeImportOrdinal;
+
 typedef struct {
     const char* name;
     int functionCount;
     PeImportedFunction* functions;
+
+    /**
+     * The ordinal index of the module. When it is direct the entry for an ordinal is at ordinal - ordinalLow and holes
+     * have an index of -1, otherwise the entries are sorted by ordinal.
+     */
+    PeImportOrdinal* ordinals;
+    int ordinalCount;
+    int ordinalLow;
+    bool ordinalsDirect;
 } PeImportModule;
 
+/**
+ * The state behind the trampoline of a lazily bound import.
+ */
 typedef struct {
-    const char* name;
-    void* address;
-    int ordinal;
-} PeExportedFunction;
+    PeFile* file;
+    PeImportModule* module;
+    PeImportedFunction* function;
+    PeLazyResolver resolver;
+    void* user;
+    void* trampoline;
+} PeLazyImport;
 
-struct PeFile {
-    //TODO Make the fileHandle and other stuff temporary, they are not needed once the PE file is loaded.
+/**
+ * A slot in the export name index, the hash is kept next to the index so most probes never touch the name.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t index;
+} PeExportIndexEntry;
+
+typedef struct {
+    PeExportIndexEntry* entries;
+    uint32_t mask;
+} PeExportIndex;
+
+/**
+ * The export tables of the PE file itself, these live inside of the loaded image.
+ */
+typedef struct {
+    const uint32_t* addresses;
+    const uint32_t* names;
+    const uint16_t* ordinals;
+    uint32_t ordinalBase;
+    uint32_t addressCount;
+    uint32_t nameCount;
+} PeExportTable;
+
+/**
+ * The image of a shareable PE file, see peloader_instantiate and peloader_share.
+ */
+typedef struct {
+    /**
+     * The sealed memfd that holds the relocated image before any imports are bound, laid out like a cache entry.
+     */
+    int handle;
+
+    /**
+     * The offset of the image in the memfd.
+     */
+    uint64_t imageOffset;
+
+    /**
+     * The image base that the image in the memfd is relocated for.
+     */
+    uint64_t base;
+
+    /**
+     * The options the file was opened with, they are used for every instance.
+     */
+    PeLoaderOpen options;
+} PeSharedImage;
+
+/**
+ * The working set profile of a PE file, see peloader_recordWorkingSet. Profiles are kept in the cache directory and are
+ * only valid for the same contents of the file.
+ */
+typedef struct {
+    char* directory;
+
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t time;
+} PeWorkingSet;
+
+/**
+ * An entry of the registry of deduplicated files, see registry.cpp.
+ */
+struct PeRegistryEntry;
+
+/**
+ * The state of an image whose pages are filled on first touch, see demand.cpp.
+ */
+struct PeDemandImage;
+
+/**
+ * The state that is only needed while a PE file is loaded, it is freed at the end of parsePeFile.
+ */
+typedef struct {
     File file;
 
     struct {
@@ -33,16 +131,62 @@ struct PeFile {
 
     PeDataDir dataDirs[16];
 
+    /**
+     * The full headers of the sections, in the same order as PeFile::sections.
+     */
+    PeSectionHeader* sectionHeaders;
+} PeLoadState;
+
+/**
+ * Hands out the parts of the arena of a PE file while it is parsed, see parsePeFile.
+ */
+typedef struct {
+    uint8_t* next;
+    uint8_t* end;
+} PeArena;
+
+struct PeFile {
+    PeLoadState* load;
+
     void* sectionAllocation;
     size_t sectionAllocationSize;
 
     PeSection* sections;
+
+    /**
+     * The section of every page of the image, starting at rvaPageLow. Pages without a section are RVA_PAGE_NONE and
+     * pages shared by several sections are RVA_PAGE_SHARED. It is kept after loading for the export lookups.
+     */
+    uint8_t* rvaPages;
+    uint32_t rvaPageLow;
+    uint32_t rvaPageCount;
+
     PeImportModule* imports;
-    PeExportedFunction* exports;
+    PeExportLookup exportLookup;
+    PeExportTable exportTable;
+    PeExportIndex exportIndex;
 
     int sectionCount;
     int importCount;
     int exportCount;
+
+    /**
+     * The single block that holds the sections, the RVA page table, the import modules with their functions and ordinal
+     * indexes, and the export name index once the file is parsed. Until then the sections and the page table are
+     * allocated on their own.
+     */
+    uint8_t* arena;
+
+    PeLazyImport* lazyImports;
+    void* lazyTrampolines;
+    size_t lazyTrampolinesSize;
+
+    PeSharedImage* shared;
+    PeRegistryEntry* registryEntry;
+    PeWorkingSet* workingSet;
+    PeDemandImage* demand;
+
+    PeLoaderStats stats;
 };
 
 #endif //PELOADER_INTERNAL_H
@@ -6,19 +6,30 @@
 #include <cstdio>
 
 extern "C" {
+#include <sys/mman.h>
 #include <sys/types.h>
 }
 
+// Older C libraries do not define this, older kernels treat it as a hint so the result always has to be checked
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE (0x100000)
+#endif
+
 #include "peloader.h"
 
 typedef enum {
     TYPE_FILE,
     TYPE_BUFFER,
+    TYPE_MAPPED,
     TYPE_CLOSED,
 } PeFileType;
 
 typedef struct {
     PeFileType fileType;
+    /**
+     * The number of I/O system calls (seeks, reads and mappings) issued against this file.
+     */
+    size_t ioCalls;
     union {
         int fileHandle;
         struct {
@@ -28,39 +39,72 @@ typedef struct {
             void* user;
             PeFileFreeCallback cleanup;
         } memFile;
+        struct {
+            const void* pointer;
+            size_t length;
+            size_t offset;
+            int fileHandle;
+        } mappedFile;
     };
 } File;
 
 static inline size_t bufferRemaining(File* file) {
-    if(file->fileType != TYPE_BUFFER) {
-        fprintf(stderr, "bufferRemaining fileType not TYPE_BUFFER");
-        abort();
+    switch(file->fileType) {
+        case TYPE_BUFFER: return file->memFile.length - file->memFile.offset;
+        case TYPE_MAPPED: return file->mappedFile.length - file->mappedFile.offset;
+        default: {
+            fprintf(stderr, "bufferRemaining fileType not TYPE_BUFFER or TYPE_MAPPED");
+            abort();
+        }
     }
-    return file->memFile.length - file->memFile.offset;
 }
 
 static inline void* bufferPointer(File* file) {
-    if(file->fileType != TYPE_BUFFER) {
-        fprintf(stderr, "bufferPointer fileType not TYPE_BUFFER");
-        abort();
-    }
     if(bufferRemaining(file) <= 0) {
         fprintf(stderr, "bufferPointer underflow");
         abort();
     }
 
+    if(file->fileType == TYPE_MAPPED) {
+        return reinterpret_cast<void*>(reinterpret_cast<intptr_t>(file->mappedFile.pointer) + file->mappedFile.offset);
+    }
     return reinterpret_cast<void*>(reinterpret_cast<intptr_t>(file->memFile.pointer) + file->memFile.offset);
 }
 
+static inline void bufferAdvance(File* file, size_t length) {
+    if(file->fileType == TYPE_MAPPED) {
+        file->mappedFile.offset += length;
+    } else {
+        file->memFile.offset += length;
+    }
+}
+
+/**
+ * A single read of a batch, see readBatch.
+ */
+typedef struct {
+    size_t offset;
+    void* buffer;
+    size_t length;
+} FileRead;
+
 int openFile(File* file, const char* path);
+void mapFile(File* file, size_t length);
+void unmapFile(File* file);
 int openMemory(File* file, const void* pointer, size_t length, PeFileFreeCallback callback, void* user);
 int closeFile(File* file);
 
 off64_t fileSeek(File* file, size_t offset);
 
+int fileSize(File* file, size_t* size);
+const void* fileView(File* file, size_t* length);
+
 ssize_t readPartially(File* file, void* buffer, size_t length);
+ssize_t readPartially(File* file, size_t offset, void* buffer, size_t length);
 int readFully(File* file, void* buffer, size_t length);
 int readFully(File* file, size_t offset, void* buffer, size_t length);
+int mapFully(File* file, size_t offset, void* buffer, size_t length);
+int readBatch(File* file, FileRead* reads, int count);
 
 template <typename T> static inline int readFully(File* file, T& buffer) {
     return readFully(file, &buffer, sizeof(buffer));
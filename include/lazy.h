@@ -0,0 +1,9 @@
+#ifndef PELOADER_LAZY_H
+#define PELOADER_LAZY_H
+
+#include "internal.h"
+
+int createLazyImports(PeFile* file, const PeLoaderOpen* options);
+void freeLazyImports(PeFile* file);
+
+#endif //PELOADER_LAZY_H
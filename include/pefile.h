@@ -109,8 +109,18 @@ typedef struct {
 
 static_assert(sizeof(PeSectionHeader) == 40, "PeSectionHeader is the wrong size");
 
+#define IMAGE_SCN_MEM_EXECUTE   (0x20000000)
+#define IMAGE_SCN_MEM_READ      (0x40000000)
+#define IMAGE_SCN_MEM_WRITE     (0x80000000)
+
+/**
+ * A section of a loaded PE file, only the parts of the header that are still needed once the file is loaded are kept.
+ * The full headers are in the load state until then.
+ */
 typedef struct {
-    PeSectionHeader header;
+    char name[8];
+    uint32_t virtualAddress;
+    uint32_t characteristics;
     void* pointer;
     size_t size;
 } PeSection;
@@ -0,0 +1,9 @@
+#ifndef PELOADER_POOL_H
+#define PELOADER_POOL_H
+
+#include <functional>
+
+int parallelFor(int threads, int count, const std::function<int(int)>& body);
+void runDetached(int threads, std::function<void()> task);
+
+#endif //PELOADER_POOL_H
@@ -0,0 +1,14 @@
+#ifndef PELOADER_REGISTRY_H
+#define PELOADER_REGISTRY_H
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+#include "internal.h"
+
+PeFile* acquireRegisteredFile(const struct stat64& stat);
+PeFile* registerFile(PeFile* file, const struct stat64& stat);
+bool releaseRegisteredFile(PeFile* file);
+
+#endif //PELOADER_REGISTRY_H
@@ -0,0 +1,44 @@
+#ifndef PELOADER_RELOCATE_H
+#define PELOADER_RELOCATE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The memory that a relocation table is applied to.
+ */
+typedef struct {
+    /**
+     * The address of RVA 0, only the RVAs from low to high are mapped.
+     */
+    uintptr_t image;
+    uint32_t low;
+    uint32_t high;
+
+    /**
+     * The difference between where the image is and where its contents assume it is.
+     */
+    int64_t delta;
+} RelocationTarget;
+
+/**
+ * The blocks of a relocation table grouped by page, see indexRelocationPages.
+ */
+typedef struct {
+    /**
+     * The offset of every block in the table, ordered by page. The blocks of page pageLow + i are the ones from
+     * starts[i] up to starts[i + 1].
+     */
+    uint32_t* blocks;
+    uint32_t* starts;
+    uint32_t pageLow;
+    uint32_t pageCount;
+} RelocationPageIndex;
+
+int relocateBlocks(const RelocationTarget* target, const uint8_t* table, size_t size);
+int relocateBlocksParallel(const RelocationTarget* target, const uint8_t* table, size_t size, int threads);
+int indexRelocationPages(const RelocationTarget* target, const uint8_t* table, size_t size, RelocationPageIndex* index);
+void relocateWindow(const RelocationTarget* window, const uint8_t* table, const RelocationPageIndex* index);
+void freeRelocationPageIndex(RelocationPageIndex* index);
+
+#endif //PELOADER_RELOCATE_H
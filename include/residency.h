@@ -0,0 +1,16 @@
+#ifndef PELOADER_RESIDENCY_H
+#define PELOADER_RESIDENCY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "internal.h"
+
+void* mapHugeAligned(size_t size, size_t offset);
+void adviseHugePages(PeFile* file);
+void populate(uintptr_t start, size_t length);
+int applyResidency(PeFile* file, const PeLoaderOpen* options);
+void measureResidency(PeFile* file, size_t* residentBytes, size_t* hugePageBytes);
+int recordWorkingSet(PeFile* file);
+
+#endif //PELOADER_RESIDENCY_H
@@ -0,0 +1,91 @@
+#ifndef PELOADER_RVA_H
+#define PELOADER_RVA_H
+
+#include <cstdint>
+
+#include "internal.h"
+
+#define RVA_PAGE_NONE (0xFF)
+#define RVA_PAGE_SHARED (0xFE)
+
+void setSections(PeFile* file, const PeSectionHeader* headers, int count);
+void buildRvaIndex(PeFile* file);
+int sectionPerms(const PeSection* section);
+int pagePerms(int perms, bool covered, bool importTable, bool lazy);
+uint32_t sectionStart(PeFile* file);
+PeSection* resolveRvaSection(PeFile* file, uint32_t rva);
+
+/**
+ * Resolves a RVA in a given segment to a virtual address.
+ *
+ * @tparam T The type of the pointer
+ * @param section The section that owns the RVA
+ * @param rva The RVA to resolve
+ * @return The pointer to virtual memory
+ */
+template <typename T> static inline T* resolveRva(PeSection* section, uint32_t rva) {
+    return reinterpret_cast<T*>(reinterpret_cast<intptr_t>(section->pointer) + rva - section->virtualAddress);
+}
+
+/**
+ * Resolves an RVA from a PeFile to a virtual address.
+ *
+ * @tparam T The type of the pointer
+ * @param file The file that owns the RVA
+ * @param rva The RVA to resolve
+ * @return The resolved pointer, or nullptr if not found
+ */
+template <typename T> static inline T* resolveRva(PeFile* file, uint32_t rva) {
+    if(rva == 0) {
+        return nullptr;
+    }
+
+    PeSection* section = resolveRvaSection(file, rva);
+
+    if(section == nullptr) {
+        return nullptr;
+    }
+
+    return resolveRva<T>(section, rva);
+}
+
+/**
+ * Resolves an RVA of an array from a PeFile to a virtual address, checking that the whole array is inside of the
+ * section that holds it.
+ *
+ * @tparam T The type of the elements
+ * @param file The file that owns the RVA
+ * @param rva The RVA of the array
+ * @param count The number of elements
+ * @return The resolved pointer, or nullptr if not found or the array does not fit in the section
+ */
+template <typename T> static inline T* resolveRvaArray(PeFile* file, uint32_t rva, uint64_t count) {
+    if(rva == 0) {
+        return nullptr;
+    }
+
+    PeSection* section = resolveRvaSection(file, rva);
+    if(section == nullptr || count * sizeof(T) > section->virtualAddress + section->size - rva) {
+        return nullptr;
+    }
+
+    return resolveRva<T>(section, rva);
+}
+
+/**
+ * Resolves an RVA from a PE data directory to a virtual address.
+ *
+ * @tparam T The type of the pointer
+ * @param file The file that owns the data directory
+ * @param dir The data directory to resolve
+ * @return The pointer to the data directory, or nullptr if not found
+ */
+template <typename T> static inline T* resolveRva(PeFile* file, PeDataDir& dir) {
+    if(dir.size == 0 && dir.virtualAddress == 0) {
+        return nullptr;
+    }
+
+    return resolveRva<T>(file, dir.virtualAddress);
+}
+
+#endif //PELOADER_RVA_H
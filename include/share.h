@@ -0,0 +1,12 @@
+#ifndef PELOADER_SHARE_H
+#define PELOADER_SHARE_H
+
+#include "internal.h"
+
+int shareImage(PeFile* file, const PeLoaderOpen* options);
+int mapSharedImage(PeFile* file, PeFile* source, uint64_t* relocateFrom);
+int openSharedImage(PeFile* file, int handle, const PeLoaderOpen* options, uint64_t* relocateFrom);
+int duplicateSharedImage(PeFile* file, int* handle);
+void freeSharedImage(PeFile* file);
+
+#endif //PELOADER_SHARE_H
@@ -19,6 +19,16 @@ extern "C" {
 
 /**
  * An opaque structure for the PE file. Required for all PE operations.
+ *
+ * An opened PE file can be used from any number of threads at once. The queries (peloader_export, peloader_exportMany,
+ * peloader_exports, peloader_modules, peloader_imports and peloader_stats) only read the file and never take a lock.
+ * peloader_import replaces an import address table slot with a single atomic store with release ordering, so code of the
+ * PE file that calls through the slot on another thread jumps to either the old or the new address. When several
+ * threads bind the same import at once the last store wins. The import address tables are read-only after loading
+ * unless lazy imports are used, so peloader_import makes the page of the slot writable only for the store. Pages that
+ * hold code as well, which only happens when the image is aligned below the page size, stay writable and executable
+ * so the code on them keeps running while imports are bound. peloader_instantiate and peloader_share can be called at
+ * any time as well. Only peloader_close must not race with any other use of the same file.
  */
 typedef struct PeFile PeFile;
 
@@ -48,14 +58,16 @@ int peloader_open(const char* path, PeFile** result);
 /**
  * The current version of the options structure.
  */
-#define PELOADER_OPTIONS_VERSION (1)
+#define PELOADER_OPTIONS_VERSION (11)
 
 /**
  * The different ways to open a PE file.
  */
 typedef enum {
     /**
-     * Open a PE file on disk, must provide a non-null path.
+     * Open a PE file on disk, must provide a non-null path. The file is mapped into memory when possible, sections whose
+     * file offset and virtual address share the same page alignment are mapped straight from the file instead of being
+     * copied.
      */
     PELOADER_OPEN_FILE = 0,
 
@@ -63,13 +75,98 @@ typedef enum {
      * Open a PE file from memory, must provide a buffer and a length.
      */
     PELOADER_OPEN_MEMORY = 1,
+
+    /**
+     * Open a PE file from a handle returned by peloader_share, usually in another process. The image is mapped at the
+     * address it was relocated for when that address is free, so nothing is read or relocated and pages that are never
+     * written stay shared with every process that maps it. Imports are bound again with the options given here. The
+     * file is shareable itself. Added in version 7.
+     */
+    PELOADER_OPEN_SHARED = 2,
 } PeLoaderOpenMode;
 
+/**
+ * The different ways exports are looked up by name.
+ */
+typedef enum {
+    /**
+     * Builds a hash index over the export names when the file is loaded, lookups take constant time.
+     */
+    PELOADER_EXPORT_LOOKUP_INDEX = 0,
+
+    /**
+     * Binary searches the sorted name table of the PE file in place, this does not allocate anything extra per file.
+     */
+    PELOADER_EXPORT_LOOKUP_NATIVE = 1,
+} PeExportLookup;
+
+/**
+ * The different ways the image is faulted in while a PE file is opened.
+ */
+typedef enum {
+    /**
+     * Pages are faulted in on first use.
+     */
+    PELOADER_PREFAULT_NONE = 0,
+
+    /**
+     * Every readable page is faulted in, pages that are only read stay shared with the file or image they are mapped
+     * from.
+     */
+    PELOADER_PREFAULT_POPULATE = 1,
+
+    /**
+     * The whole image is locked into memory with mlock, which also makes every writable page private. Opening fails
+     * when the image is larger than the memory lock limit allows.
+     */
+    PELOADER_PREFAULT_LOCK = 2,
+} PePrefault;
+
 /**
  * A callback that is invoked when a PE file loaded from memory is closed, used to free the provided memory buffer.
  */
 typedef void (*PeFileFreeCallback)(const void* buffer, void* user);
 
+/**
+ * A callback that resolves the imports of a module while a PE file is being loaded, it is invoked once per imported
+ * module with every symbol imported from it. The address of a symbol is already set if it was bound by the binding
+ * table, the callback sets the address of every symbol it can resolve and leaves the rest alone.
+ *
+ * @param module The name of the imported module
+ * @param symbols The symbols imported from the module
+ * @param count The number of symbols
+ * @param user The user data from the options
+ * @return 0 on success, <0 to abort loading the file with that error
+ */
+typedef int (*PeImportResolver)(const char* module, PeSymbol* symbols, int count, void* user);
+
+/**
+ * A callback that resolves a single import the first time it is called when lazy binding is enabled. It may be invoked
+ * from any thread that calls into the PE file, and more than once for the same symbol if several threads race on the
+ * first call.
+ *
+ * @param module The name of the module the symbol is imported from
+ * @param symbol The imported symbol
+ * @param user The user data from the options
+ * @return The address to bind the symbol to, NULL aborts the process with the name of the symbol
+ */
+typedef void* (*PeLazyResolver)(const char* module, const PeSymbol* symbol, void* user);
+
+/**
+ * An entry of a static import binding table.
+ */
+typedef struct {
+    /**
+     * The name of the module the symbol is imported from.
+     */
+    const char* module;
+
+    /**
+     * The symbol to bind, matched by ordinal and then by name like peloader_import.
+     */
+    PeSymbol symbol;
+} PeImportBinding;
+
 /**
  * The options for peloader_openEx
  */
@@ -92,6 +189,10 @@ typedef struct {
          * Path mode only: the path to the file to open.
          */
         const char* path;
+        /**
+         * Shared mode only: the handle to open, the caller keeps ownership of it.
+         */
+        int handle;
         /**
          * Memory mode only
          */
@@ -117,10 +218,147 @@ typedef struct {
             void* user;
         };
     } file;
+
+    /**
+     * How exports are looked up by name. Added in version 2.
+     */
+    PeExportLookup exportLookup;
+
+    /**
+     * Imports that are bound while the file is loaded, before the memory permissions are applied. The binding table is
+     * applied first and then the resolver is invoked. Added in version 3.
+     */
+    struct {
+        /**
+         * The optional callback that resolves the imports of each module.
+         */
+        PeImportResolver resolver;
+
+        /**
+         * The user data to pass to the resolver.
+         */
+        void* user;
+
+        /**
+         * The optional table of symbols to bind.
+         */
+        const PeImportBinding* bindings;
+
+        /**
+         * The number of entries in the binding table.
+         */
+        int bindingCount;
+    } imports;
+
+    /**
+     * Lazy import binding. When a resolver is set every import that is still unbound after the options above are
+     * applied is pointed at a small trampoline, the first call through it resolves the import, updates the import
+     * address table and continues on to the resolved address. Added in version 4.
+     */
+    struct {
+        /**
+         * The optional callback that resolves an import on its first call.
+         */
+        PeLazyResolver resolver;
+
+        /**
+         * The user data to pass to the resolver.
+         */
+        void* user;
+    } lazyImports;
+
+    /**
+     * The optional directory of the image cache, only used by PELOADER_OPEN_FILE. The first time a file is opened the
+     * relocated image is written to the cache, later opens map it at the same address and skip reading the file and
+     * processing the relocations. Entries are checked against the size and modification time of the file and fall back
+     * to a hash of its contents when only the time changed. The directory must exist and is trusted, anything that can
+     * write to it can change the code that gets loaded. Added in version 5.
+     */
+    const char* cacheDirectory;
+
+    /**
+     * How the base relocations are applied. Added in version 6.
+     */
+    struct {
+        /**
+         * The most threads to apply the relocations of a large image with, the opening thread included. Threads come
+         * from a pool shared by the whole process. 0 and 1 apply the relocations on the opening thread.
+         */
+        int threads;
+
+        /**
+         * The smallest relocation table, in entries, that is split across threads. 0 uses a default of 65536.
+         */
+        int threshold;
+    } relocation;
+
+    /**
+     * Non-zero keeps the relocated image in shared memory so more instances of the file can be created with
+     * peloader_instantiate. Every instance is opened with these options again, so the binding table, the resolvers and
+     * their user data have to stay valid for as long as instances are created. Added in version 7.
+     */
+    int shareable;
+
+    /**
+     * Non-zero looks the file up in a process wide registry of files opened with this option, only used by
+     * PELOADER_OPEN_FILE. Files are matched by device, inode, size and modification time. When the file is already open
+     * the same PeFile is returned with its reference count increased and every other option is ignored, peloader_close
+     * drops a reference and the file is closed with the last one. Imports bound on a deduplicated file are seen by every
+     * holder. Looking up a file that is already open does not take any lock. Added in version 8.
+     */
+    int deduplicate;
+
+    /**
+     * How the memory of the image is backed, peloader_sections reports the effect. Added in version 9.
+     */
+    struct {
+        /**
+         * Non-zero asks for transparent huge pages for the executable sections. The image is placed on a 2 MiB
+         * boundary when it can not be mapped at its image base, executable sections are copied from the file instead of
+         * mapped, and sections that are mapped from a cache entry or a shared image are collapsed into huge pages after
+         * loading. The system has to allow transparent huge pages for madvise or always.
+         */
+        int hugePages;
+
+        /**
+         * How the image is faulted in.
+         */
+        PePrefault prefault;
+
+        /**
+         * Non-zero starts reading the read-only data sections in the background, this helps images that are mapped
+         * from the image cache or a shared image.
+         */
+        int willNeed;
+    } memory;
+
+    /**
+     * Non-zero keeps a profile of the pages that are used in the cache directory, only used when the image is mapped
+     * from the image cache since a copied image has every page present. The pages in the profile are faulted in when
+     * the file is opened, unless it is prefaulted as a whole, and the rest is faulted in on first use. The profile is
+     * recorded when the file is closed and with peloader_recordWorkingSet. Pages stay in the profile once they are in
+     * it, it starts over when the file changes. Added in version 10.
+     */
+    int workingSet;
+
+    /**
+     * Non-zero fills the pages of the image when they are first touched instead of reading every section when the file
+     * is opened. Threads of the library fill the pages from the file through userfaultfd and apply the relocations of
+     * every page as they go, so opening only reads the headers and the relocation table and only the pages that are
+     * used take memory. The file stays open until the PE file is closed, and like with a mapped file a page that can
+     * not be read from it raises SIGBUS in the thread that touched it. When userfaultfd is not available the sections
+     * are read like always, peloader_stats tells which happened. Demand paged images are not written to the image
+     * cache. The pages that are still missing are filled before the process forks since a child would see them as
+     * zero, so every fork, including the ones behind system and popen, reads the parts of the image that were not
+     * touched yet. Only the first fork after the open pays for that. Not used for images that come from the image
+     * cache or a shared image. Added in version 11.
+     */
+    int demandPaging;
 } PeLoaderOpen;
 
 /**
- * Opens a PE file with the given options. The documentation for the structure explains the options.
+ * Opens a PE file with the given options. The documentation for the structure explains the options. Older versions of
+ * the structure are accepted, anything added after the provided version uses the default value.
  *
  * @param options The options of the PE file to open
  * @param result The opened PE file
@@ -129,12 +367,98 @@ typedef struct {
 int peloader_openEx(const PeLoaderOpen* options, PeFile** result);
 
 /**
- * Closes an opened PE file and sets the pointer to NULL.
+ * Opens many PE files at once like peloader_openEx. The files are spread over a pool of threads shared by the whole
+ * process, so opening them takes about as long as the slowest one instead of all of them added up. Every file is
+ * opened independently, a file that fails to open does not affect the others.
+ *
+ * @param options The options of every file to open
+ * @param count The number of files
+ * @param results Set to the opened files, NULL for the ones that failed to open
+ * @param errors Set to the result of opening each file, may be NULL
+ * @return the number of files that could not be opened, <0 on error
+ */
+int peloader_openMany(const PeLoaderOpen* options, int count, PeFile** results, int* errors);
+
+/**
+ * An opaque handle to an open that runs in the background, see peloader_openAsync.
+ */
+typedef struct PeOpenTask PeOpenTask;
+
+/**
+ * A callback that is invoked once when an asynchronous open finishes. It runs on a thread of the pool, not the thread
+ * that started the open.
+ *
+ * @param result 0 on success, -ECANCELED if the open was cancelled, <0 on other errors
+ * @param file The opened PE file or NULL, the callback takes ownership of it
+ * @param user The user data passed to peloader_openAsync
+ */
+typedef void (*PeOpenCallback)(int result, PeFile* file, void* user);
+
+/**
+ * Opens a PE file like peloader_openEx without blocking the calling thread. Reading the file, the relocations and the
+ * memory permissions are done on a pool of threads shared by the whole process and the callback is invoked when the
+ * file is open. The options are copied, but everything they point to (paths, buffers, binding tables) has to stay valid
+ * until the callback is invoked.
+ *
+ * @param options The options of the PE file to open
+ * @param callback The callback to invoke when the open finishes
+ * @param user The user data to pass to the callback
+ * @param task Set to a handle to cancel the open with, may be NULL. It has to be released with peloader_releaseOpen.
+ * @return 0 if the open was started, <0 on error, the callback is not invoked then
+ */
+int peloader_openAsync(const PeLoaderOpen* options, PeOpenCallback callback, void* user, PeOpenTask** task);
+
+/**
+ * Asks an asynchronous open to stop. The open checks for this between its stages and finishes with -ECANCELED, an open
+ * that is already past its last check still finishes normally. The callback is invoked either way.
+ *
+ * @param task The open to cancel
+ */
+void peloader_cancelOpen(PeOpenTask* task);
+
+/**
+ * Releases the handle to an asynchronous open and sets the pointer to NULL. This does not cancel the open, and it may be
+ * called before or after the callback was invoked, including from the callback itself.
+ *
+ * @param task The handle to release
+ */
+void peloader_releaseOpen(PeOpenTask** task);
+
+/**
+ * Creates another instance of a PE file that was opened as shareable. Every instance has its own globals and import
+ * bindings, pages that are written to by relocations, import binding or the code itself are private to the instance and
+ * the rest are shared with the file it was created from. Instances are closed with peloader_close, can be instantiated
+ * themselves and can outlive the file they were created from.
+ *
+ * @param file The shareable PE file to instantiate
+ * @param result The new instance
+ * @return 0 on success, <0 on error
+ */
+int peloader_instantiate(PeFile* file, PeFile** result);
+
+/**
+ * Gets a handle to the image of a PE file that was opened as shareable, so it can be opened with PELOADER_OPEN_SHARED
+ * in another process. The handle is a sealed memfd with the relocated image and everything needed to map it, it can be
+ * inherited across fork or passed over a unix socket. It does not hold any import bindings, every process binds its own.
+ * The caller owns the handle and closes it when it is no longer needed, the image stays valid as long as any handle or
+ * mapping of it is open.
+ *
+ * @param file The shareable PE file
+ * @param handle Set to the new handle
+ * @return 0 on success, <0 on error
+ */
+int peloader_share(PeFile* file, int* handle);
+
+/**
+ * Closes an opened PE file and sets the pointer to NULL. A file opened with deduplicate is only closed once every open
+ * of it is closed.
  */
 void peloader_close(PeFile** file);
 
 /**
- * Binds an imported symbol to the given PE file.
+ * Binds an imported symbol to the given PE file. Imports can be bound again at any time, including while other threads
+ * are running code of the PE file. When the slot is on a read-only page it is made writable just for the store, slots
+ * on a page with code are always writable so that code never stops being executable.
  *
  * @param file The file to bind a address to
  * @param module The name of the module the address is imported from
@@ -152,6 +476,117 @@ int peloader_import(PeFile* file, const char* module, const PeSymbol* symbol);
  */
 int peloader_export(PeFile* file, PeSymbol* symbol);
 
+/**
+ * Gets many exported symbols from the PE file in one call. The name or ordinal of every symbol is read like
+ * peloader_export, symbols that can not be found have their address set to NULL so all of the misses can be reported
+ * at once.
+ *
+ * @param file The file that exported the symbols
+ * @param symbols The symbols to get
+ * @param count The number of symbols
+ * @param failedIndex Set to the index of the first symbol that could not be found or -1, may be NULL
+ * @return the number of symbols that could not be found, <0 on error
+ */
+int peloader_exportMany(PeFile* file, PeSymbol* symbols, int count, int* failedIndex);
+
+/**
+ * The current version of the statistics structure.
+ */
+#define PELOADER_STATS_VERSION (4)
+
+/**
+ * Statistics about how a PE file was loaded.
+ */
+typedef struct {
+    /**
+     * The version of the structure, must be set by the caller. Older versions only get the fields they know about.
+     */
+    int version;
+
+    /**
+     * The number of I/O system calls (seeks, reads and mappings) that where used to load the file.
+     */
+    size_t ioCalls;
+
+    /**
+     * Non-zero when the image was loaded from the image cache. Added in version 2.
+     */
+    int cacheHit;
+
+    /**
+     * Non-zero when the image was mapped at the image base from its headers, relocations are skipped when it is.
+     * Added in version 3.
+     */
+    int preferredBase;
+
+    /**
+     * Non-zero when the pages of the image are filled when they are first touched, see demandPaging in PeLoaderOpen.
+     * Added in version 4.
+     */
+    int demandPaged;
+} PeLoaderStats;
+
+/**
+ * Gets the statistics of how a PE file was loaded.
+ *
+ * @param file The PE file to query
+ * @param stats The statistics to fill in, the version must be set to a known version
+ * @return 0 on success, <0 on error
+ */
+int peloader_stats(PeFile* file, PeLoaderStats* stats);
+
+/**
+ * Information about a section of a loaded PE file.
+ */
+typedef struct {
+    /**
+     * The name of the section, always null terminated.
+     */
+    char name[9];
+
+    /**
+     * The address and size of the section in memory.
+     */
+    void* address;
+    size_t size;
+
+    /**
+     * The PROT_ flags of the section from its header.
+     */
+    int protection;
+
+    /**
+     * The bytes of the section that are currently resident, counted in whole pages.
+     */
+    size_t residentBytes;
+
+    /**
+     * The bytes of the section that are backed by transparent huge pages. The kernel only reports huge pages per
+     * mapping, they are split between the sections in a mapping by size.
+     */
+    size_t hugePageBytes;
+} PeSectionInfo;
+
+/**
+ * Gets a list of the sections of a PE file that are in memory. If sections is NULL this only gets the count of
+ * sections.
+ *
+ * @param file The PE file to query
+ * @param sections An array of sections or NULL
+ * @return the count of sections, <0 on error
+ */
+int peloader_sections(PeFile* file, PeSectionInfo* sections);
+
+/**
+ * Records the pages of a PE file that this process has touched so far as its working set, the next open of the file
+ * faults them in up front. peloader_close records the working set as well, this is for processes that do not close
+ * their files or want to capture the pages of a specific phase like startup.
+ *
+ * @param file A PE file that was opened with workingSet
+ * @return 0 on success, -EINVAL if the file does not keep a profile, <0 on error
+ */
+int peloader_recordWorkingSet(PeFile* file);
+
 /**
  * Gets a list of modules that the PE file imported. If names is NULL this only gets the count of modules imported.
  *
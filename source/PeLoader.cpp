@@ -1,14 +1,17 @@
 /*
 TODO:
- - Faster symbol lookups (binary search, hash map?)
  - Non-AMD64 support
  - Non-Linux support
  */
 
+#include <atomic>
 #include <cerrno>
+#include <climits>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <thread>
 
 extern "C" {
 #include <fcntl.h>
@@ -16,9 +19,20 @@ extern "C" {
 #include <sys/mman.h>
 }
 
+#include "cache.h"
+#include "demand.h"
+#include "exports.h"
+#include "imports.h"
 #include "internal.h"
 #include "io.h"
+#include "lazy.h"
 #include "pefile.h"
+#include "pool.h"
+#include "registry.h"
+#include "relocate.h"
+#include "residency.h"
+#include "rva.h"
+#include "share.h"
 
 #include "peloader.h"
 
@@ -45,166 +59,239 @@ static inline size_t max(size_t a, size_t b) {
 }
 
 /**
- * Cleans up all resources associated with the provided PeFile.
+ * Allocates a PE file along with the state it needs while it is loaded.
  *
- * @param file The file to cleanup
+ * @param exportLookup The lookup method for the exports of the file
+ * @return The new PE file
  */
-static void cleanup(PeFile* file) {
-    closeFile(&file->file);
-
-    if(file->importCount != 0) {
-        for(int i = 0; i < file->importCount; i++) {
-            auto module = &file->imports[i];
-            delete[] module->functions;
-        }
+static PeFile* createPeFile(PeExportLookup exportLookup) {
+    auto file = new PeFile();
+    file->load = new PeLoadState();
+    file->load->file.fileType = TYPE_CLOSED;
+    file->exportLookup = exportLookup;
+    return file;
+}
 
-        delete[] file->imports;
+/**
+ * Frees the state of a PE file that is only needed while it is loaded, see PeLoadState.
+ *
+ * @param file The file to free the load state of
+ */
+static void freeLoadState(PeFile* file) {
+    auto load = file->load;
+    if(load == nullptr) {
+        return;
     }
 
-    delete file->exports;
+    closeFile(&load->file);
+    delete[] load->sectionHeaders;
+    delete load;
+    file->load = nullptr;
+}
+
+/**
+ * Cleans up all resources associated with the provided PeFile.
+ *
+ * @param file The file to cleanup
+ */
+static void cleanup(PeFile* file) {
+    freeLoadState(file);
+    freeLazyImports(file);
+    freeSharedImage(file);
+    freeWorkingSet(file);
+    stopDemandPaging(file);
 
     if(file->sectionAllocation != nullptr) {
         munmap(file->sectionAllocation, file->sectionAllocationSize);
     }
-    delete[] file->sections;
+
+    // The sections and the page table are only allocated on their own until parsePeFile moves them into the arena
+    if(file->arena == nullptr) {
+        delete[] file->sections;
+        delete[] file->rvaPages;
+    }
+    delete[] file->arena;
 
     delete file;
 }
 
 /**
- * A generic way to read some data from a file into memory. It will only read up to *remaining bytes from the file, even
- * if the buffer object is larger. On successful read remaining will be updated to reflect how many bytes where
- * transferred.
- *
- * @tparam T The type of the buffer
- * @param file The file to read from
- * @param buffer The buffer to read to
- * @param remaining A pointer to the amount of bytes to read
- * @return 0 on success, <0 on error
+ * The amount of the file that is read up front when the headers can not be viewed in place. This covers the headers of
+ * almost every PE file so they only need one read.
  */
-template <typename T> static int readOptionalHeader(PeFile* file, T& buffer, uint16_t* remaining) {
-    auto transferred = readPartially(&file->file, &buffer, min(*remaining, sizeof(buffer)));
-    if(transferred < 0) return (int) transferred;
-    *remaining -= transferred;
-    return 0;
-}
+#define HEADER_READ_SIZE (0x1000)
 
 /**
- * Resolves an RVA from a PE file to the section that contains it.
+ * Copies a structure out of the header region, checking that it is in bounds first.
  *
- * @param file The file that contains the RVA
- * @param rva The RVA to resolve
- * @return The section if found, nullptr if missing
+ * @tparam T The type of the structure
+ * @param headers The header region
+ * @param length The length of the header region
+ * @param offset The offset of the structure in the header region
+ * @param value The structure to copy into
+ * @return true if the structure was in bounds, false otherwise
  */
-static PeSection* resolveRvaSection(PeFile* file, uint32_t rva) {
-    for(int i = 0; i < file->sectionCount; i++) {
-        auto current = &file->sections[i];
-        if(current->header.virtualAddress <= rva && current->header.virtualAddress + current->size > rva) {
-            return current;
-        }
+template <typename T> static bool readHeader(const uint8_t* headers, size_t length, size_t offset, T& value) {
+    if(offset > length || length - offset < sizeof(value)) {
+        return false;
     }
 
-    return nullptr;
-}
-
-/**
- * Resolves a RVA in a given segment to a virtual address.
- *
- * @tparam T The type of the pointer
- * @param section The section that owns the RVA
- * @param rva The RVA to resolve
- * @return The pointer to virtual memory
- */
-template <typename T> static T* resolveRva(PeSection* section, uint32_t rva) {
-    return reinterpret_cast<T*>(reinterpret_cast<intptr_t>(section->pointer) + rva - section->header.virtualAddress);
+    memcpy(&value, headers + offset, sizeof(value));
+    return true;
 }
 
 /**
- * Resolves an RVA from a PeFile to a virtual address.
+ * Figures out how much of the start of the file is needed to parse all of the headers, based on as much of the headers
+ * as is present in the provided region.
  *
- * @tparam T The type of the pointer
- * @param file The file that owns the RVA
- * @param rva The RVA to resolve
- * @return The resolved pointer, or nullptr if not found
+ * @param headers The start of the header region
+ * @param length The length of the header region
+ * @return The size of the header region required to parse the headers
  */
-template <typename T> static T* resolveRva(PeFile* file, uint32_t rva) {
-    if(rva == 0) {
-        return nullptr;
+static size_t headerRegionSize(const uint8_t* headers, size_t length) {
+    DosHeader dosHeader;
+    if(!readHeader(headers, length, 0, dosHeader)) {
+        return sizeof(dosHeader);
     }
 
-    PeSection* section = resolveRvaSection(file, rva);
-
-    if(section == nullptr) {
-        return nullptr;
+    PeHeader peHeader;
+    if(!readHeader(headers, length, dosHeader.peOff, peHeader)) {
+        return (size_t) dosHeader.peOff + sizeof(peHeader);
     }
 
-    return resolveRva<T>(section, rva);
+    return (size_t) dosHeader.peOff + sizeof(peHeader) + peHeader.sizeOfOptionalHeader +
+        peHeader.numberOfSections * sizeof(PeSectionHeader);
 }
 
 /**
- * Resolves an RVA from a PE data directory to a virtual address.
+ * Gets the header region of a PE file. Memory backed files are viewed in place, anything else is read with as few
+ * calls as possible into a buffer that the caller has to free. Headers that claim to extend past the end of the file are
+ * rejected before anything is allocated for them.
  *
- * @tparam T The type of the pointer
- * @param file The file that owns the data directory
- * @param dir The data directory to resolve
- * @return The pointer to the data directory, or nullptr if not found
+ * @param file The PE file to read
+ * @param headers The header region
+ * @param length The length of the header region
+ * @param buffer The buffer that has to be freed with delete[] once the headers are parsed, or nullptr
+ * @return 0 on success, <0 on error
  */
-template <typename T> static T* resolveRva(PeFile* file, PeDataDir& dir) {
-    if(dir.size == 0 && dir.virtualAddress == 0) {
-        return nullptr;
+static int readHeaders(PeFile* file, const uint8_t** headers, size_t* length, uint8_t** buffer) {
+    *buffer = nullptr;
+
+    auto view = fileView(&file->load->file, length);
+    if(view != nullptr) {
+        *headers = static_cast<const uint8_t*>(view);
+        return 0;
+    }
+
+    size_t size;
+    auto result = fileSize(&file->load->file, &size);
+    if(result < 0) {
+        return result;
     }
 
-    return resolveRva<T>(file, dir.virtualAddress);
+    size_t wanted = min((size_t) HEADER_READ_SIZE, size);
+    while(true) {
+        auto current = new uint8_t[wanted];
+        auto transferred = readPartially(&file->load->file, 0, current, wanted);
+        if(transferred < 0) {
+            delete[] current;
+            delete[] *buffer;
+            *buffer = nullptr;
+            return (int) transferred;
+        }
+        delete[] *buffer;
+        *buffer = current;
+        *headers = current;
+        *length = transferred;
+
+        // Either everything is here or the file is too short, the parser will catch the latter
+        auto required = headerRegionSize(current, transferred);
+        if(required <= (size_t) transferred || (size_t) transferred < wanted) {
+            return 0;
+        } else if(required > size) {
+            delete[] current;
+            *buffer = nullptr;
+            return -EINVAL;
+        }
+        wanted = required;
+    }
 }
 
 /**
- * Parses the headers from a PE file.
+ * Parses the headers from the header region of a PE file.
  *
  * @param file The PE file to parse
- * @param peHeader The parsed headers
+ * @param headers The header region of the file
+ * @param length The length of the header region
  * @return 0 on success, <0 on failure
  */
-static int parsePeHeaders(PeFile* file, PeHeader& peHeader) {
-    // There is potential for the optional header to be truncated. So if it is we only read what we can
-    uint16_t remainingHeader = peHeader.sizeOfOptionalHeader - sizeof(uint16_t);
+static int parsePeHeaders(PeFile* file, const uint8_t* headers, size_t length) {
+    DosHeader dosHeader;
+    if(!readHeader(headers, length, 0, dosHeader) || dosHeader.magic != DOS_MAGIC) {
+        return -EINVAL;
+    }
 
-    if(remainingHeader) {
-        auto result = readOptionalHeader(file, file->headers.std, &remainingHeader);
-        if(result < 0) return result;
+    size_t offset = dosHeader.peOff;
+    PeHeader peHeader;
+    if(!readHeader(headers, length, offset, peHeader)) {
+        return -EINVAL;
     }
+    offset += sizeof(peHeader);
 
-    if(remainingHeader) {
-        auto result = readOptionalHeader(file, file->headers.win, &remainingHeader);
-        if(result < 0) return result;
+    if(peHeader.magic != PE_MAGIC || peHeader.sizeOfOptionalHeader < 2) {
+        return -EINVAL;
     }
 
-    for(int i = 0; i < 16 && remainingHeader; i++) {
-        auto result = readOptionalHeader(file, file->dataDirs[i], &remainingHeader);
-        if(result < 0) return result;
+    // The sections are right after the optional header, no pointers or anything
+    size_t sectionOffset = offset + peHeader.sizeOfOptionalHeader;
+    if(sectionOffset > length || (length - sectionOffset) / sizeof(PeSectionHeader) < peHeader.numberOfSections) {
+        return -EINVAL;
     }
 
-    // The sections are right after the PE header, no pointers or anything
-    auto sections = new PeSection[peHeader.numberOfSections];
-    for(int i = 0; i < peHeader.numberOfSections; i++) {
-        auto result = readFully(&file->file, sections[i].header);
-        if(result < 0) {
-            delete[] sections;
-            return result;
-        }
+    uint16_t magic;
+    if(!readHeader(headers, length, offset, magic)) {
+        return -EINVAL;
     }
-    file->sectionCount = peHeader.numberOfSections;
-    file->sections = sections;
+    offset += sizeof(magic);
+
+    //TODO This should support other arches (with ifdefs)
+    if(magic != PE32_PLUS_MAGIC) {
+        return -EINVAL;
+    }
+
+    // There is potential for the optional header to be truncated. So if it is we only copy what is there
+    auto optional = headers + offset;
+    size_t remainingHeader = peHeader.sizeOfOptionalHeader - sizeof(magic);
+
+    auto load = file->load;
+    auto copy = min(remainingHeader, sizeof(load->headers.std));
+    memcpy(&load->headers.std, optional, copy);
+    optional += copy;
+    remainingHeader -= copy;
+
+    copy = min(remainingHeader, sizeof(load->headers.win));
+    memcpy(&load->headers.win, optional, copy);
+    optional += copy;
+    remainingHeader -= copy;
+
+    copy = min(remainingHeader, sizeof(load->dataDirs));
+    memcpy(load->dataDirs, optional, copy);
+
+    // The section headers may not be aligned in the header region, setSections copies them out
+    setSections(file, reinterpret_cast<const PeSectionHeader*>(headers + sectionOffset), peHeader.numberOfSections);
 
     return 0;
 }
 
 /**
- * Allocates a block of contiguous memory and reads the sections into it.
+ * Allocates a block of contiguous memory and reads the sections into it. The memory is placed at the image base from
+ * the headers when that is free, which makes the relocations unnecessary.
  *
  * @param file The PE file to read the sections from
+ * @param options The options the file was opened with
  * @return 0 on success, <0 on ereror
  */
-static int readSegments(PeFile* file) {
+static int readSegments(PeFile* file, const PeLoaderOpen* options) {
     // The lowest and highest addresses of the sections without the PE image base applied.
     size_t baselessStart = SIZE_MAX;
     size_t baselessEnd = 0;
@@ -213,107 +300,349 @@ static int readSegments(PeFile* file) {
     for(int i = 0; i < file->sectionCount; i++) {
         auto section = &file->sections[i];
 
-        if(section->header.virtualSize == 0) {
+        if(section->size == 0) {
             continue;
         }
-        section->size = section->header.virtualSize;
 
-        baselessStart = min(baselessStart, section->header.virtualAddress);
-        baselessEnd = max(baselessEnd, section->header.virtualAddress + section->header.virtualSize);
+        baselessStart = min(baselessStart, section->virtualAddress);
+        baselessEnd = max(baselessEnd, section->virtualAddress + section->size);
     }
 
     // Round up to the nearest page
     baselessEnd = (baselessEnd + 0x1000) & ~0xFFF;
 
     size_t allocationSize = baselessEnd - baselessStart;
-    void* allocation = mmap(
-        nullptr,
-        allocationSize,
-        PROT_READ | PROT_WRITE,
-        MAP_ANONYMOUS | MAP_PRIVATE,
-        -1,
-        0
-    );
+
+    // Try the address the image was linked for first, the relocations can be skipped when it is free
+    auto imageBase = file->load->headers.win.imageBase;
+    auto preferred = imageBase + baselessStart;
+    void* allocation = MAP_FAILED;
+    if((preferred & 0xFFF) == 0 && preferred >= imageBase) {
+        allocation = mmap(
+            reinterpret_cast<void*>(preferred),
+            allocationSize,
+            PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+            -1,
+            0
+        );
+    }
+    if(allocation == MAP_FAILED && options->memory.hugePages) {
+        allocation = mapHugeAligned(allocationSize, baselessStart);
+    }
+    if(allocation == MAP_FAILED) {
+        allocation = mmap(
+            nullptr,
+            allocationSize,
+            PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE,
+            -1,
+            0
+        );
+    }
     if(allocation == MAP_FAILED) {
         return -errno;
     }
+    file->stats.preferredBase = reinterpret_cast<uintptr_t>(allocation) == preferred;
+
+    // Need this for later
+    file->sectionAllocation = allocation;
+    file->sectionAllocationSize = allocationSize;
 
     auto pointer = reinterpret_cast<intptr_t>(allocation);
 
+    // Since the memory we have is contiguous we can do simple math to drop the sections in
     for(int i = 0; i < file->sectionCount; i++) {
         auto section = &file->sections[i];
+        if(section->size != 0) {
+            section->pointer = reinterpret_cast<void*>(section->virtualAddress - baselessStart + pointer);
+        }
+    }
+    if(options->memory.hugePages) {
+        adviseHugePages(file);
+    }
+    buildRvaIndex(file);
+
+    // Demand paged images are filled on first touch, the sections are only read here when that is not possible
+    if(options->demandPaging) {
+        auto result = startDemandPaging(file);
+        if(result != -ENOTSUP) return result;
+    }
+
+    // Mapped files get their sections mapped in place, everything else is read in a single batch
+    auto source = &file->load->file;
+    bool mapped = source->fileType == TYPE_MAPPED;
+    auto reads = mapped ? nullptr : new FileRead[file->sectionCount];
+    int readCount = 0;
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        auto header = &file->load->sectionHeaders[i];
         if(section->size == 0) {
             continue;
         }
 
-        // Since the memory we have is contiguous we can do simple math to drop the sections in
-        auto sectionOffset = section->header.virtualAddress - baselessStart;
-        auto sectionPointer = reinterpret_cast<void*>(sectionOffset + pointer);
-        section->pointer = sectionPointer;
-
         // There are sections that only exist in memory (like BSS)
-        if(section->header.pointerToRawData != 0) {
-            auto result = readFully(
-                &file->file,
-                section->header.pointerToRawData,
-                sectionPointer,
-                min(section->header.sizeOfRawData, section->size)
-            );
+        if(header->pointerToRawData == 0) {
+            continue;
+        }
+
+        auto sectionPointer = section->pointer;
+        auto length = min(header->sizeOfRawData, section->size);
+        if(mapped && options->memory.hugePages && (section->characteristics & IMAGE_SCN_MEM_EXECUTE) != 0) {
+            // Pages mapped from the file can not be huge pages
+            auto result = readFully(source, header->pointerToRawData, sectionPointer, length);
             if(result < 0) return result;
+        } else if(mapped) {
+            auto result = mapFully(source, header->pointerToRawData, sectionPointer, length);
+            if(result < 0) return result;
+        } else {
+            reads[readCount].offset = header->pointerToRawData;
+            reads[readCount].buffer = sectionPointer;
+            reads[readCount].length = length;
+            readCount++;
         }
     }
 
-    // Need this for later
-    file->sectionAllocationSize = allocationSize;
+    if(reads != nullptr) {
+        auto result = readBatch(source, reads, readCount);
+        delete[] reads;
+        if(result < 0) return result;
+    }
 
     return 0;
 }
 
 /**
- * A basic error handler for an unbound import, we don't mandate that all imports are bound before usage of a symbol.
+ * Counts the import descriptors of a PE file, the table ends with an empty descriptor.
+ *
+ * @param descriptors The import descriptors or nullptr
+ * @return The number of descriptors
  */
-static PE_FUNC void unboundImport() {
-    fprintf(stderr, "An unbound import was called!\n");
-    abort();
+static int countImportDescriptors(const PeImportDescriptor* descriptors) {
+    int count = 0;
+    while(descriptors != nullptr && descriptors[count].nameRva != 0) {
+        count++;
+    }
+    return count;
 }
 
 /**
- * Parses the imports from a PE file.
+ * Counts the entries of an import address table, the table ends with a zero entry.
+ *
+ * @param importTable The import address table or nullptr
+ * @return The number of entries
+ */
+static int countImportEntries(const uint64_t* importTable) {
+    int count = 0;
+    while(importTable != nullptr && importTable[count] != 0) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Gets the size of the ordinal index of an import module from its import address table, see importOrdinalIndexSize.
+ *
+ * @param importTable The import address table
+ * @param importCount The number of entries
+ * @return The number of entries of the ordinal index
+ */
+static int importTableOrdinalIndexSize(const uint64_t* importTable, int importCount) {
+    int count = 0;
+    int low = INT_MAX;
+    int high = INT_MIN;
+    for(int i = 0; i < importCount; i++) {
+        if(importTable[i] & 0x8000000000000000L) {
+            int ordinal = (uint16_t) (importTable[i] & 0x000000000000FFFFL);
+            count++;
+            low = ordinal < low ? ordinal : low;
+            high = ordinal > high ? ordinal : high;
+        }
+    }
+    return importOrdinalIndexSize(count, low, high);
+}
+
+/**
+ * Rounds a size up so that whatever follows it in the arena is aligned.
+ *
+ * @param size The size to round
+ * @return The rounded size
+ */
+static inline size_t arenaAlign(size_t size) {
+    return (size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+}
+
+/**
+ * Takes an array from the arena of a PE file.
+ *
+ * @tparam T The type of the elements
+ * @param arena The arena
+ * @param count The number of elements
+ * @return The array, or nullptr if it does not fit in the arena
+ */
+template <typename T> static T* arenaAllocate(PeArena* arena, size_t count) {
+    auto size = arenaAlign(count * sizeof(T));
+    if((size_t) (arena->end - arena->next) < size) {
+        return nullptr;
+    }
+
+    auto array = reinterpret_cast<T*>(arena->next);
+    arena->next += size;
+    return array;
+}
+
+/**
+ * Resolves one of the export tables of a PE file. A table that is missing is treated as empty, one that runs past the
+ * end of its section is broken.
+ *
+ * @tparam T The type of the entries
+ * @param file The PE file
+ * @param rva The RVA of the table
+ * @param count The number of entries from the export descriptor
+ * @param table Set to the table, or nullptr if it is missing
+ * @return 0 on success, <0 on error
+ */
+template <typename T> static int resolveExportTable(PeFile* file, uint32_t rva, uint32_t count, T** table) {
+    *table = resolveRvaArray<T>(file, rva, count);
+    if(*table == nullptr && count != 0 && resolveRva<T>(file, rva) != nullptr) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Reads the location of the export tables of a PE file. The number of functions and names come straight from the file,
+ * so every table has to fit in the section that holds it before anything is sized from them.
+ *
+ * @param file The PE file to read
+ * @return 0 on success, <0 on error
+ */
+static int readExportTable(PeFile* file) {
+    auto table = &file->exportTable;
+    *table = {};
+
+    auto dataDir = &file->load->dataDirs[EXPORT_TABLE_DIR];
+    auto descriptor = resolveRvaArray<PeExportDescriptor>(file, dataDir->virtualAddress, 1);
+    if(descriptor == nullptr) {
+        return 0;
+    }
+
+    table->ordinalBase = descriptor->ordinalBase;
+    table->addressCount = descriptor->addressTableEntries;
+    table->nameCount = descriptor->numberOfNamePointers;
+    if(
+        resolveExportTable(file, descriptor->exportAddressTableRva, table->addressCount, &table->addresses) < 0 ||
+        resolveExportTable(file, descriptor->namePointerRva, table->nameCount, &table->names) < 0 ||
+        resolveExportTable(file, descriptor->ordinalTableRva, table->nameCount, &table->ordinals) < 0
+    ) {
+        return -EINVAL;
+    }
+
+    if(table->addresses == nullptr) {
+        table->addressCount = 0;
+    }
+    if(table->names == nullptr || table->ordinals == nullptr) {
+        table->nameCount = 0;
+    }
+    return 0;
+}
+
+/**
+ * Works out how large the arena of a PE file has to be. The import tables are walked the same way that parseImports
+ * walks them, the export tables have already been checked by readExportTable.
+ *
+ * @param file The file to measure
+ * @return The size of the arena in bytes
+ */
+static size_t arenaSize(PeFile* file) {
+    auto size = arenaAlign(file->sectionCount * sizeof(PeSection));
+    size += arenaAlign(file->rvaPageCount);
+
+    auto descriptors = resolveRva<PeImportDescriptor>(file, file->load->dataDirs[IMPORT_TABLE_DIR].virtualAddress);
+    auto count = countImportDescriptors(descriptors);
+    size += arenaAlign(count * sizeof(PeImportModule));
+    for(int i = 0; i < count; i++) {
+        auto importTable = resolveRva<uint64_t>(file, descriptors[i].importTable);
+        auto importCount = countImportEntries(importTable);
+        size += arenaAlign(importCount * sizeof(PeImportedFunction));
+        size += arenaAlign(importTableOrdinalIndexSize(importTable, importCount) * sizeof(PeImportOrdinal));
+    }
+
+    if(file->exportLookup == PELOADER_EXPORT_LOOKUP_INDEX) {
+        size += arenaAlign(exportIndexCapacity(file->exportTable.nameCount) * sizeof(PeExportIndexEntry));
+    }
+
+    return size;
+}
+
+/**
+ * Allocates the arena of a PE file and moves the sections and the RVA page table into it, everything else that is
+ * parsed goes after them.
+ *
+ * @param file The file to allocate the arena of
+ * @param arena Set to the rest of the arena
+ */
+static void createArena(PeFile* file, PeArena* arena) {
+    auto size = arenaSize(file);
+    auto block = new uint8_t[size];
+    arena->next = block;
+    arena->end = block + size;
+
+    auto sections = arenaAllocate<PeSection>(arena, file->sectionCount);
+    memcpy(sections, file->sections, file->sectionCount * sizeof(PeSection));
+    delete[] file->sections;
+    file->sections = sections;
+
+    if(file->rvaPages != nullptr) {
+        auto pages = arenaAllocate<uint8_t>(arena, file->rvaPageCount);
+        memcpy(pages, file->rvaPages, file->rvaPageCount);
+        delete[] file->rvaPages;
+        file->rvaPages = pages;
+    }
+    file->arena = block;
+}
+
+/**
+ * Parses the imports from a PE file and binds any that are provided by the options.
  *
  * @param file The file to parse
+ * @param options The options the file was opened with
+ * @param arena The arena to take the modules from
  * @return 0 on success, <0 on error
  */
-static int parseImports(PeFile* file) {
-    auto dataDir = &file->dataDirs[IMPORT_TABLE_DIR];
+static int parseImports(PeFile* file, const PeLoaderOpen* options, PeArena* arena) {
+    auto dataDir = &file->load->dataDirs[IMPORT_TABLE_DIR];
     auto descriptors = resolveRva<PeImportDescriptor>(file, dataDir->virtualAddress);
     if(descriptors == nullptr) {
         return 0;
     }
 
     // Find the count since we don't have a reliable way to calculate this.
-    int count = 0;
-    while(descriptors[count].nameRva != 0) {
-        count++;
-    }
+    int count = countImportDescriptors(descriptors);
 
-    auto modules = new PeImportModule[count];
+    auto modules = arenaAllocate<PeImportModule>(arena, count);
+    if(modules == nullptr) {
+        return -ENOMEM;
+    }
 
     for(int i = 0; i < count; i++) {
+        modules[i] = {};
         modules[i].name = resolveRva<char>(file, descriptors[i].nameRva);
 
         auto importTable = resolveRva<uint64_t>(file, descriptors[i].importTable);
         if(importTable == nullptr) {
-            modules[i].functionCount = 0;
-            modules[i].functions = nullptr;
             continue;
         }
 
-        int importCount = 0;
-        while(importTable[importCount] != 0) {
-            importCount++;
+        int importCount = countImportEntries(importTable);
+
+        auto functions = arenaAllocate<PeImportedFunction>(arena, importCount);
+        auto ordinals = arenaAllocate<PeImportOrdinal>(arena, importTableOrdinalIndexSize(importTable, importCount));
+        if(functions == nullptr || ordinals == nullptr) {
+            return -ENOMEM;
         }
 
-        auto functions = new PeImportedFunction[importCount];
         for(int o = 0; o < importCount; o++) {
             auto importEntry = importTable[o];
             auto function = &functions[o];
@@ -335,288 +664,623 @@ static int parseImports(PeFile* file) {
 
         modules[i].functionCount = importCount;
         modules[i].functions = functions;
+        buildImportOrdinalIndex(&modules[i], ordinals);
     }
 
     file->importCount = count;
     file->imports = modules;
 
+    auto result = bindImports(file, options);
+    if(result < 0) return result;
+
+    return createLazyImports(file, options);
+}
+
+/**
+ * Parses the exports from a PE file. The tables stay in the image, only the name index is built.
+ *
+ * @param file The PE file to parse, readExportTable has to have read its export tables
+ * @param arena The arena to take the name index from
+ * @return 0 on success, <0 on error
+ */
+static int parseExports(PeFile* file, PeArena* arena) {
+    auto table = &file->exportTable;
+
+    // The address table is indexed by the ordinal minus the base and may have holes, only the filled slots are listed
+    int count = 0;
+    for(uint32_t i = 0; i < table->addressCount; i++) {
+        count += table->addresses[i] != 0;
+    }
+    file->exportCount = count;
+
+    if(file->exportLookup == PELOADER_EXPORT_LOOKUP_INDEX) {
+        auto entries = arenaAllocate<PeExportIndexEntry>(arena, exportIndexCapacity(table->nameCount));
+        if(entries == nullptr) {
+            return -ENOMEM;
+        }
+        return buildExportIndex(file, entries);
+    }
     return 0;
 }
 
 /**
- * Parses the exports from a PE file.
+ * The smallest relocation table, in entries, that is split across threads when the options don't set one.
+ */
+#define DEFAULT_RELOCATION_THRESHOLD (65536)
+
+/**
+ * Process the segment relocations in a PE file. This accounts for differences in where the file is loaded and where the
+ * compiler assumed it would be loaded. Essentially this just adds the difference in the two addresses to all of the
+ * listed addresses that need updating.
  *
- * @param file The PE file to parse
- * @return 0 on success, -1 on error
+ * @param file The PE file to relocate
+ * @param base The image base the contents of the image currently assume
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
  */
-static int parseExports(PeFile* file) {
-    auto dataDir = &file->dataDirs[EXPORT_TABLE_DIR];
-    auto descriptor = resolveRva<PeExportDescriptor>(file, dataDir->virtualAddress);
-    if(descriptor == nullptr) {
+static int relocateFile(PeFile* file, uint64_t base, const PeLoaderOpen* options) {
+    auto dataDir = &file->load->dataDirs[BASE_RELOCATION_TABLE_DIR];
+    auto relocations = resolveRva<uint8_t>(file, *dataDir);
+    if(relocations == nullptr) return 0;
+
+    // The table has to be inside of the section that holds it
+    auto tableSection = resolveRvaSection(file, dataDir->virtualAddress);
+    auto size = min(dataDir->size, tableSection->virtualAddress + tableSection->size - dataDir->virtualAddress);
+
+    // The sections are contiguous in memory, so every RVA is at the same offset from the allocation
+    auto low = sectionStart(file);
+
+    RelocationTarget target;
+    target.image = reinterpret_cast<uintptr_t>(file->sectionAllocation) - low;
+    target.low = low;
+    target.high = (uint32_t) (low + file->sectionAllocationSize);
+    target.delta = (int64_t) (target.image - base);
+    if(target.delta == 0) {
         return 0;
     }
 
-    int count = (int) descriptor->addressTableEntries;
-    if(count < 0) {
-        return -EINVAL;
-    }
+    auto threshold = options->relocation.threshold != 0 ? options->relocation.threshold : DEFAULT_RELOCATION_THRESHOLD;
+    if(options->relocation.threads > 1 && size / sizeof(uint16_t) >= (size_t) threshold) {
+        return relocateBlocksParallel(&target, relocations, size, options->relocation.threads);
+    }
+    return relocateBlocks(&target, relocations, size);
+}
+
+#define PAGE_SIZE (0x1000)
+
+/**
+ * Marks a page that a section covers in the permission map of applySegmentPerms.
+ */
+#define PAGE_COVERED (0x10)
+
+/**
+ * Marks a page that holds part of an import address table in the permission map of applySegmentPerms.
+ */
+#define PAGE_IMPORT_TABLE (0x20)
+
+/**
+ * The PROT_ flags in an entry of the permission map of applySegmentPerms.
+ */
+#define PAGE_PERMS (PROT_READ | PROT_WRITE | PROT_EXEC)
+
+/**
+ * Applies the permissions of the sections to memory. Takes everything from RW to the correct flags. The permissions are
+ * worked out per page first with the rules of pagePerms, so every run of pages with the same flags takes one mprotect
+ * call.
+ *
+ * @param file The file to apply memory permissions to
+ * @return 0 on success, <0 on error
+ */
+static int applySegmentPerms(PeFile* file) {
+    auto allocation = reinterpret_cast<uintptr_t>(file->sectionAllocation);
+    auto pageCount = file->sectionAllocationSize / PAGE_SIZE;
+    auto pages = new uint8_t[pageCount]();
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->pointer == nullptr || section->size == 0) {
+            continue;
+        }
+
+        auto perms = sectionPerms(section) | PAGE_COVERED;
+        auto start = reinterpret_cast<uintptr_t>(section->pointer) - allocation;
+        auto end = min((start + section->size + PAGE_SIZE - 1) / PAGE_SIZE, pageCount);
+        for(auto page = start / PAGE_SIZE; page < end; page++) {
+            pages[page] |= perms;
+        }
+    }
+
+    for(int i = 0; i < file->importCount; i++) {
+        auto module = &file->imports[i];
+        if(module->functionCount == 0) {
+            continue;
+        }
+
+        auto start = reinterpret_cast<uintptr_t>(module->functions[0].address);
+        auto end = reinterpret_cast<uintptr_t>(module->functions[module->functionCount - 1].address + 1);
+        if(start < allocation || end > allocation + pageCount * PAGE_SIZE) {
+            delete[] pages;
+            return -EINVAL;
+        }
+        for(auto page = (start - allocation) / PAGE_SIZE; page < (end - allocation + PAGE_SIZE - 1) / PAGE_SIZE; page++) {
+            pages[page] |= PAGE_IMPORT_TABLE;
+        }
+    }
+
+    auto lazy = file->lazyImports != nullptr;
+    for(size_t page = 0; page < pageCount; page++) {
+        auto entry = pages[page];
+        pages[page] = (uint8_t) pagePerms(
+            entry & PAGE_PERMS, (entry & PAGE_COVERED) != 0, (entry & PAGE_IMPORT_TABLE) != 0, lazy
+        );
+    }
+
+    int result = 0;
+    for(size_t page = 0; page < pageCount && result == 0;) {
+        auto end = page + 1;
+        while(end < pageCount && pages[end] == pages[page]) {
+            end++;
+        }
+
+        if(mprotect(reinterpret_cast<void*>(allocation + page * PAGE_SIZE), (end - page) * PAGE_SIZE, pages[page]) != 0) {
+            result = -errno;
+        }
+        page = end;
+    }
+
+    delete[] pages;
+    return result;
+}
+
+/**
+ * An open that runs on the pool, see peloader_openAsync. It is freed once the open finished and the caller released it.
+ */
+struct PeOpenTask {
+    PeLoaderOpen options;
+    PeOpenCallback callback;
+    void* user;
+
+    std::atomic<bool> cancelled;
+    std::atomic<int> references;
+};
+
+/**
+ * Checks if an open was cancelled, opens that can not be cancelled have no flag.
+ *
+ * @param cancelled The cancel flag of the open or nullptr
+ * @return true if the open should stop
+ */
+static inline bool isCancelled(const std::atomic<bool>* cancelled) {
+    return cancelled != nullptr && cancelled->load(std::memory_order_relaxed);
+}
+
+/**
+ * Reads the image of a PE file into memory and relocates it, the image is written to the cache afterwards when the
+ * options have one.
+ *
+ * @param file The file to read
+ * @param options The options the file was opened with
+ * @param cancelled The cancel flag of the open or nullptr, checked before the relocations are applied
+ * @return 0 on success, <0 on error
+ */
+static int loadImage(PeFile* file, const PeLoaderOpen* options, const std::atomic<bool>* cancelled) {
+    const uint8_t* headers = nullptr;
+    size_t headersLength = 0;
+    uint8_t* headersBuffer;
+    auto result = readHeaders(file, &headers, &headersLength, &headersBuffer);
+    if(result < 0) return result;
+
+    result = parsePeHeaders(file, headers, headersLength);
+    delete[] headersBuffer;
+    if(result < 0) return result;
 
-    //TODO This is technically wrong, but I don't want to fix it right now.
-    auto ordinalBase = (int) descriptor->ordinalBase;
-    auto addresses = resolveRva<uint32_t>(file, descriptor->exportAddressTableRva);
-    auto names = resolveRva<uint32_t>(file, descriptor->namePointerRva);
-    auto ordinals = resolveRva<uint16_t>(file, descriptor->ordinalTableRva);
+    result = readSegments(file, options);
+    if(result < 0) return result;
 
-    auto exports = new PeExportedFunction[count];
+    if(isCancelled(cancelled)) {
+        return -ECANCELED;
+    }
 
-    for(int i = 0; i < count; i++) {
-        int ordinal = ordinalBase + ordinals[i];
-        const char* name = nullptr;
-        if(i < descriptor->numberOfNamePointers) {
-            name = resolveRva<char>(file, names[i]);
-        }
-        auto address = resolveRva<void>(file, addresses[i]);
+    // Demand paged images apply the relocations of a page when it is filled, and writing the cache would fill them all
+    if(!file->stats.preferredBase && file->demand == nullptr) {
+        result = relocateFile(file, file->load->headers.win.imageBase, options);
+        if(result < 0) return result;
+    }
 
-        auto current = &exports[i];
-        current->name = name;
-        current->ordinal = ordinal;
-        current->address = address;
+    // The cache is an optimization, failing to write it does not fail the load
+    if(options->cacheDirectory != nullptr && file->demand == nullptr) {
+        storeCachedImage(file, options->cacheDirectory);
     }
 
-    file->exportCount = count;
-    file->exports = exports;
+    closeFile(&file->load->file);
 
     return 0;
 }
 
 /**
- * Process the segment relocations in a PE file. This accounts for differences in where the file is loaded and where the
- * compiler assumed it would be loaded. Essentially this just adds the difference in the two addresses to all of the
- * listed addresses that need updating.
+ * Parses the imports and exports of a loaded image and applies the memory permissions. What is kept of the parse goes
+ * into the arena of the file, and the load state is freed once the tables are parsed.
  *
- * @param file The PE file to relocate
- * @return 0 on success, -1 on error
+ * @param file The file to parse
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
  */
-static int relocateFile(PeFile* file) {
-    auto relocations = resolveRva<void>(file, file->dataDirs[BASE_RELOCATION_TABLE_DIR]);
-    if(relocations == nullptr) return 0;
+static int parsePeFile(PeFile* file, const PeLoaderOpen* options) {
+    auto result = readExportTable(file);
+    if(result < 0) return result;
 
-    /*
-    The format of this table is kind of odd, it's headers mixed with data.
-     */
-    auto pointer = reinterpret_cast<intptr_t>(relocations);
-    auto end = pointer + file->dataDirs[BASE_RELOCATION_TABLE_DIR].size;
+    PeArena arena;
+    createArena(file, &arena);
 
-    while(pointer < end) {
-        auto addressRva = *reinterpret_cast<uint32_t*>(pointer);
-        auto size = *reinterpret_cast<uint32_t*>(pointer + sizeof(addressRva));
+    result = parseImports(file, options, &arena);
+    if(result < 0) return result;
 
-        if(addressRva == 0 || size == 0) {
-            break;
-        }
+    result = parseExports(file, &arena);
+    if(result < 0) return result;
 
-        auto currentSection = resolveRvaSection(file, addressRva);
-        if(currentSection == nullptr) {
-            return -EINVAL;
-        }
+    freeLoadState(file);
+
+    result = applySegmentPerms(file);
+    if(result < 0) return result;
+
+    return applyResidency(file, options);
+}
 
-        auto sectionBase = (intptr_t) file->headers.win.imageBase + currentSection->header.virtualAddress;
-        auto sectionOffset = reinterpret_cast<intptr_t>(currentSection->pointer) - sectionBase;
+int peloader_open(const char* path, PeFile** result) {
+    if(!path || !result) {
+        return -EINVAL;
+    }
 
-        int offset = sizeof(addressRva) + sizeof(size);
-        while(offset < size) {
-            auto raw = *reinterpret_cast<uint16_t*>(pointer + offset);
-            offset += sizeof(raw);
+    PeLoaderOpen options = {};
+    options.version = PELOADER_OPTIONS_VERSION;
+    options.mode = PELOADER_OPEN_FILE;
+    options.file.path = path;
+    return peloader_openEx(&options, result);
+}
 
-            // Top 4 bits are the type, bottom 12 are the offset of this table
-            auto type = raw >> 12;
-            auto offset = raw & 0x0FFF;
+/**
+ * Gets the size of a version of the options structure, everything past it is left at the defaults.
+ *
+ * @param version The version of the structure
+ * @return The size of the structure, 0 if the version is unknown
+ */
+static size_t optionsSize(int version) {
+    switch(version) {
+        case 1: return offsetof(PeLoaderOpen, exportLookup);
+        case 2: return offsetof(PeLoaderOpen, imports);
+        case 3: return offsetof(PeLoaderOpen, lazyImports);
+        case 4: return offsetof(PeLoaderOpen, cacheDirectory);
+        case 5: return offsetof(PeLoaderOpen, relocation);
+        case 6: return offsetof(PeLoaderOpen, shareable);
+        case 7: return offsetof(PeLoaderOpen, deduplicate);
+        case 8: return offsetof(PeLoaderOpen, memory);
+        case 9: return offsetof(PeLoaderOpen, workingSet);
+        case 10: return offsetof(PeLoaderOpen, demandPaging);
+        case PELOADER_OPTIONS_VERSION: return sizeof(PeLoaderOpen);
+        default: return 0;
+    }
+}
 
-            //TODO Implement the other relocations
-            switch(type) {
-                // Everyone needs a NOP, it's for padding
-                case 0: break;
+/**
+ * Opens the source of a PE file based on the open mode.
+ *
+ * @param file The PE file to open the source of
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
+ */
+static int openSource(PeFile* file, const PeLoaderOpen* options) {
+    switch(options->mode) {
+        case PELOADER_OPEN_FILE: {
+            // Opened by openPeFile already
+            auto source = &file->load->file;
+            size_t size;
+            auto result = fileSize(source, &size);
+            if(result < 0) return result;
+            mapFile(source, size);
+        } break;
 
-                // A 64 bit raw offset, nothing fancy.
-                case 10: {
-                    *resolveRva<uint64_t>(currentSection, offset + addressRva) += sectionOffset;
-                } break;
+        case PELOADER_OPEN_MEMORY: {
+            if(options->file.buffer == nullptr || options->file.length == 0) {
+                return -EINVAL;
+            }
 
-                default: {
-                    fprintf(stderr, "peloader: unknown relocation type: %X (%d)\n", type);
-                    fflush(stderr);
-                    abort();
-                }
+            if(openMemory(&file->load->file, options->file.buffer, options->file.length, options->file.callback, options->file.user) != 0) {
+                return -errno;
             }
-        }
+        } break;
 
-        // The size in the header also counts the header.
-        pointer += size;
+        default: return -EINVAL;
     }
 
     return 0;
 }
 
-#define IMAGE_SCN_MEM_EXECUTE   (0x20000000)
-#define IMAGE_SCN_MEM_READ      (0x40000000)
-#define IMAGE_SCN_MEM_WRITE     (0x80000000)
-
 /**
- * Applies the permissions of the sections to memory. Takes everything from RW to the correct flags.
+ * Copies the options of an open and checks them.
  *
- * @param file The file to apply memory permissions to
+ * @param options The options from the caller
+ * @param copy The options with everything past the version of the caller set to the defaults
  * @return 0 on success, <0 on error
  */
-static int applySegmentPerms(PeFile* file) {
-    for(int i = 0; i < file->sectionCount; i++) {
-        auto section = &file->sections[i];
+static int copyOptions(const PeLoaderOpen* options, PeLoaderOpen* copy) {
+    auto size = optionsSize(options->version);
+    if(size == 0) {
+        return -EINVAL;
+    }
 
-        auto characteristics = section->header.characteristics;
-        int perms = (characteristics & IMAGE_SCN_MEM_EXECUTE) != 0 ? PROT_EXEC : 0;
-        perms |= (characteristics & IMAGE_SCN_MEM_READ) != 0 ? PROT_READ : 0;
-        perms |= (characteristics & IMAGE_SCN_MEM_WRITE) != 0 ? PROT_WRITE : 0;
+    *copy = {};
+    memcpy(copy, options, size);
 
-        auto result = mprotect(section->pointer, section->size, perms);
-        if(result != 0) return -errno;
+    if(
+        copy->exportLookup != PELOADER_EXPORT_LOOKUP_INDEX &&
+        copy->exportLookup != PELOADER_EXPORT_LOOKUP_NATIVE
+    ) {
+        return -EINVAL;
+    }
+    if(copy->relocation.threads < 0 || copy->relocation.threshold < 0) {
+        return -EINVAL;
+    }
+    if(copy->memory.prefault < PELOADER_PREFAULT_NONE || copy->memory.prefault > PELOADER_PREFAULT_LOCK) {
+        return -EINVAL;
     }
 
     return 0;
 }
 
 /**
- * Parses and loads a PE file into memory.
+ * Opens a PE file on disk and gets its status from the descriptor, so the status always matches what gets loaded.
  *
- * @param file The file to read
+ * @param source The file to open
+ * @param path The path of the file
+ * @param stat Set to the status of the file
  * @return 0 on success, <0 on error
  */
-static int parsePeFile(PeFile* file) {
-    {
-        DosHeader dosHeader;
-        auto result = readFully(&file->file, dosHeader);
-        if(result < 0) return result;
-
-        if(dosHeader.magic != DOS_MAGIC) {
-            return -EINVAL;
-        }
+static int openSourceFile(File* source, const char* path, struct stat64* stat) {
+    if(path == nullptr) {
+        return -EINVAL;
+    }
 
-        if(fileSeek(&file->file, dosHeader.peOff) == (off_t) -1) {
-            return -errno;
-        }
+    auto result = openFile(source, path);
+    if(result < 0) {
+        source->fileType = TYPE_CLOSED;
+        return result;
     }
+    if(fstat64(source->fileHandle, stat) != 0) {
+        result = -errno;
+        closeFile(source);
+        return result;
+    }
+    return 0;
+}
 
-    PeHeader peHeader;
-    auto result = readFully(&file->file, peHeader);
-    if(result < 0) return result;
+/**
+ * Opens a PE file, the stages are the same for every open mode: load the image, share it, then parse the imports and
+ * exports. The cancel flag is checked between the stages.
+ *
+ * @param options The checked options
+ * @param cancelled The cancel flag of the open or nullptr
+ * @param result The opened PE file
+ * @return 0 on success, -ECANCELED if the open was cancelled, <0 on error
+ */
+static int openPeFile(const PeLoaderOpen* options, const std::atomic<bool>* cancelled, PeFile** result) {
+    if(isCancelled(cancelled)) {
+        return -ECANCELED;
+    }
 
-    if(peHeader.magic != PE_MAGIC || peHeader.sizeOfOptionalHeader < 2) {
-        return -EINVAL;
+    // Files on disk are opened first, the registry and the image cache are keyed on the status of the file that is
+    // actually loaded and not on whatever the path points to at some other time
+    File source;
+    source.fileType = TYPE_CLOSED;
+    struct stat64 stat;
+    if(options->mode == PELOADER_OPEN_FILE) {
+        auto res = openSourceFile(&source, options->file.path, &stat);
+        if(res < 0) return res;
     }
 
-    uint16_t magic;
-    result = readFully(&file->file, magic);
-    if(result < 0) return result;
+    auto deduplicate = options->deduplicate && options->mode == PELOADER_OPEN_FILE;
+    if(deduplicate) {
+        auto registered = acquireRegisteredFile(stat);
+        if(registered != nullptr) {
+            closeFile(&source);
+            *result = registered;
+            return 0;
+        }
+    }
 
-    //TODO This should support other arches (with ifdefs)
-    if(magic == PE32_PLUS_MAGIC) {
-        result = parsePeHeaders(file, peHeader);
+    auto file = createPeFile(options->exportLookup);
+    file->load->file = source;
+
+    int res;
+    uint64_t relocateFrom = 0;
+    if(
+        options->mode == PELOADER_OPEN_FILE && options->cacheDirectory != nullptr &&
+        loadCachedImage(file, options->cacheDirectory, stat, &relocateFrom) == 0
+    ) {
+        file->stats.cacheHit = 1;
+
+        // Only a mapped image faults in pages as they are used, a copied one has every page present. Without a profile
+        // the file still loads, it just does not get one.
+        if(options->workingSet) {
+            openWorkingSet(file, options->cacheDirectory, stat);
+        }
+        res = relocateFrom != 0 ? relocateFile(file, relocateFrom, options) : 0;
+    } else if(options->mode == PELOADER_OPEN_SHARED) {
+        res = openSharedImage(file, options->file.handle, options, &relocateFrom);
+        if(res == 0 && relocateFrom != 0) {
+            res = relocateFile(file, relocateFrom, options);
+        }
     } else {
-        result = EIO;
+        res = openSource(file, options);
+        if(res == 0) {
+            res = loadImage(file, options, cancelled);
+        }
+    }
+    file->stats.ioCalls = file->load->file.ioCalls;
+    if(res == 0 && isCancelled(cancelled)) {
+        res = -ECANCELED;
+    }
+    if(res == 0 && options->shareable && file->shared == nullptr) {
+        res = shareImage(file, options);
+    }
+    if(res == 0) {
+        res = parsePeFile(file, options);
+    }
+    if(res) {
+        cleanup(file);
+        return res;
     }
-    if(result < 0) return result;
-
-    result = readSegments(file);
-    if(result < 0) return result;
 
-    result = parseImports(file);
-    if(result < 0) return result;
+    if(deduplicate) {
+        auto registered = registerFile(file, stat);
+        if(registered != file) {
+            cleanup(file);
+            file = registered;
+        }
+    }
 
-    result = parseExports(file);
-    if(result < 0) return result;
+    *result = file;
 
-    result = relocateFile(file);
-    if(result < 0) return result;
+    return 0;
+}
 
-    result = applySegmentPerms(file);
-    if(result < 0) return result;
+int peloader_openEx(const PeLoaderOpen* options, PeFile** result) {
+    if(!options || !result) {
+        return -EINVAL;
+    }
 
-    closeFile(&file->file);
+    PeLoaderOpen optionsCopy;
+    auto res = copyOptions(options, &optionsCopy);
+    if(res < 0) return res;
 
-    return result;
+    return openPeFile(&optionsCopy, nullptr, result);
 }
 
-int peloader_open(const char* path, PeFile** result) {
-    if(!path || !result) {
+int peloader_openMany(const PeLoaderOpen* options, int count, PeFile** results, int* errors) {
+    if(options == nullptr || count < 0 || results == nullptr) {
         return -EINVAL;
     }
 
-    PeLoaderOpen options;
-    options.version = PELOADER_OPTIONS_VERSION;
-    options.mode = PELOADER_OPEN_FILE;
-    options.file.path = path;
-    return peloader_openEx(&options, result);
+    auto threads = (int) std::thread::hardware_concurrency();
+    std::atomic<int> failed(0);
+    parallelFor(threads > 0 ? threads : 1, count, [&](int index) {
+        results[index] = nullptr;
+        auto result = peloader_openEx(&options[index], &results[index]);
+        if(errors != nullptr) {
+            errors[index] = result;
+        }
+        if(result < 0) {
+            failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        return 0;
+    });
+
+    return failed.load(std::memory_order_relaxed);
 }
 
-int peloader_openEx(const PeLoaderOpen* options, PeFile** result) {
-    if(!options || !result) {
-        return -EINVAL;
+/**
+ * Drops a reference to an asynchronous open.
+ *
+ * @param task The open
+ */
+static void releaseTask(PeOpenTask* task) {
+    if(task->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete task;
     }
+}
 
-    PeLoaderOpen optionsCopy;
-    memcpy(&optionsCopy, options, sizeof(*options));
-    if(optionsCopy.version != PELOADER_OPTIONS_VERSION) {
+int peloader_openAsync(const PeLoaderOpen* options, PeOpenCallback callback, void* user, PeOpenTask** result) {
+    if(options == nullptr || callback == nullptr) {
         return -EINVAL;
     }
 
-    auto file = new PeFile;
+    auto task = new PeOpenTask();
+    auto res = copyOptions(options, &task->options);
+    if(res < 0) {
+        delete task;
+        return res;
+    }
+    task->callback = callback;
+    task->user = user;
+    task->cancelled = false;
+    task->references = result != nullptr ? 2 : 1;
+
+    // Set before the open starts, the callback may want to release it
+    if(result != nullptr) {
+        *result = task;
+    }
 
-    switch(optionsCopy.mode) {
-        case PELOADER_OPEN_FILE: {
-            if(optionsCopy.file.path == nullptr) {
-                cleanup(file);
-                return EINVAL;
-            }
+    auto threads = (int) std::thread::hardware_concurrency();
+    runDetached(threads > 0 ? threads : 1, [task]() {
+        PeFile* file = nullptr;
+        auto res = openPeFile(&task->options, &task->cancelled, &file);
+        task->callback(res, res == 0 ? file : nullptr, task->user);
+        releaseTask(task);
+    });
 
-            if(openFile(&file->file, optionsCopy.file.path) != 0) {
-                cleanup(file);
-                return -errno;
-            }
-        } break;
+    return 0;
+}
 
-        case PELOADER_OPEN_MEMORY: {
-            if(optionsCopy.file.buffer == nullptr || optionsCopy.file.length == 0) {
-                cleanup(file);
-                return EINVAL;
-            }
+void peloader_cancelOpen(PeOpenTask* task) {
+    if(task != nullptr) {
+        task->cancelled.store(true, std::memory_order_relaxed);
+    }
+}
 
-            if(openMemory(&file->file, optionsCopy.file.buffer, optionsCopy.file.length, optionsCopy.file.callback, optionsCopy.file.user) != 0) {
-                cleanup(file);
-                return -errno;
-            }
-        } break;
+void peloader_releaseOpen(PeOpenTask** task) {
+    if(task == nullptr || *task == nullptr) {
+        return;
+    }
 
-        default: {
-            cleanup(file);
-            return -EINVAL;
-        } break;
+    releaseTask(*task);
+
+    *task = nullptr;
+}
+
+int peloader_instantiate(PeFile* file, PeFile** result) {
+    if(file == nullptr || result == nullptr || file->shared == nullptr) {
+        return -EINVAL;
     }
 
-    auto res = parsePeFile(file);
+    auto instance = createPeFile(file->exportLookup);
+
+    uint64_t relocateFrom = 0;
+    auto res = mapSharedImage(instance, file, &relocateFrom);
+    if(res == 0 && relocateFrom != 0) {
+        res = relocateFile(instance, relocateFrom, &file->shared->options);
+    }
+    if(res == 0) {
+        res = parsePeFile(instance, &file->shared->options);
+    }
     if(res) {
-        cleanup(file);
+        cleanup(instance);
         return res;
     }
 
-    *result = file;
+    *result = instance;
 
     return 0;
 }
 
+int peloader_share(PeFile* file, int* handle) {
+    if(file == nullptr || handle == nullptr || file->shared == nullptr) {
+        return -EINVAL;
+    }
+
+    return duplicateSharedImage(file, handle);
+}
+
 void peloader_close(PeFile** file) {
-    if(file == nullptr) {
+    if(file == nullptr || *file == nullptr) {
         return;
     }
 
-    cleanup(*file);
+    if((*file)->registryEntry == nullptr || releaseRegisteredFile(*file)) {
+        // Best effort, the file closes either way
+        if((*file)->workingSet != nullptr) {
+            recordWorkingSet(*file);
+        }
+        cleanup(*file);
+    }
 
     *file = nullptr;
 }
@@ -677,16 +1341,12 @@ int peloader_import(PeFile* file, const char* module, const PeSymbol* symbol) {
     PeImportedFunction* imported = nullptr;
     // Ordinals should be faster, check those first (if present)
     if(symbol->ordinal != -1) {
-        for(int i = 0; i < importModule->functionCount; i++) {
-            if(symbol->ordinal == importModule->functions[i].ordinal) {
-                imported = &importModule->functions[i];
-                break;
-            }
-        }
+        imported = findImportOrdinal(importModule, symbol->ordinal);
     }
     if(imported == nullptr && symbol->name != nullptr) {
         for(int i = 0; i < importModule->functionCount; i++) {
-            if(strcmp(symbol->name, importModule->functions[i].name) == 0) {
+            auto name = importModule->functions[i].name;
+            if(name != nullptr && strcmp(symbol->name, name) == 0) {
                 imported = &importModule->functions[i];
                 break;
             }
@@ -696,9 +1356,7 @@ int peloader_import(PeFile* file, const char* module, const PeSymbol* symbol) {
         return -EINVAL;
     }
 
-    *imported->address = symbol->address;
-
-    return 0;
+    return storeImport(file, imported->address, symbol->address);
 }
 
 int peloader_export(PeFile* file, PeSymbol* symbol) {
@@ -706,33 +1364,133 @@ int peloader_export(PeFile* file, PeSymbol* symbol) {
         return -EINVAL;
     }
 
-    PeExportedFunction* exportedFunction = nullptr;
+    int64_t slot = -1;
     // Ordinals should be faster, check those first (if present)
     if(symbol->ordinal != -1) {
-        for(int i = 0; i < file->exportCount; i++) {
-            if(symbol->ordinal == file->exports[i].ordinal) {
-                exportedFunction = &file->exports[i];
-                break;
-            }
-        }
+        slot = findOrdinalSlot(file, symbol->ordinal);
     }
-    if(exportedFunction == nullptr && symbol->name != nullptr) {
-        for(int i = 0; i < file->exportCount; i++) {
-            if(file->exports[i].name != nullptr && strcmp(symbol->name, file->exports[i].name) == 0) {
-                exportedFunction = &file->exports[i];
-                break;
+    if(slot < 0 && symbol->name != nullptr) {
+        slot = findExportSlot(file, symbol->name);
+    }
+    if(slot < 0) {
+        return -EINVAL;
+    }
+
+    symbol->address = exportAddress(file, (uint32_t) slot);
+
+    return 0;
+}
+
+int peloader_exportMany(PeFile* file, PeSymbol* symbols, int count, int* failedIndex) {
+    if(file == nullptr || count < 0 || (symbols == nullptr && count != 0)) {
+        return -EINVAL;
+    }
+
+    auto slots = new int64_t[count];
+    findExportSlots(file, symbols, count, slots);
+
+    int failed = 0;
+    int firstFailed = -1;
+    for(int i = 0; i < count; i++) {
+        if(slots[i] < 0) {
+            symbols[i].address = nullptr;
+            if(failed++ == 0) {
+                firstFailed = i;
             }
+        } else {
+            symbols[i].address = exportAddress(file, (uint32_t) slots[i]);
         }
     }
-    if(exportedFunction == nullptr) {
+
+    delete[] slots;
+
+    if(failedIndex != nullptr) {
+        *failedIndex = firstFailed;
+    }
+    return failed;
+}
+
+/**
+ * Gets the size of a version of the statistics structure.
+ *
+ * @param version The version of the structure
+ * @return The size of the structure, 0 if the version is unknown
+ */
+static size_t statsSize(int version) {
+    switch(version) {
+        case 1: return offsetof(PeLoaderStats, cacheHit);
+        case 2: return offsetof(PeLoaderStats, preferredBase);
+        case 3: return offsetof(PeLoaderStats, demandPaged);
+        case PELOADER_STATS_VERSION: return sizeof(PeLoaderStats);
+        default: return 0;
+    }
+}
+
+int peloader_stats(PeFile* file, PeLoaderStats* stats) {
+    if(file == nullptr || stats == nullptr) {
         return -EINVAL;
     }
 
-    symbol->address = exportedFunction->address;
+    auto version = stats->version;
+    auto size = statsSize(version);
+    if(size == 0) {
+        return -EINVAL;
+    }
+
+    memcpy(stats, &file->stats, size);
+    stats->version = version;
 
     return 0;
 }
 
+int peloader_sections(PeFile* file, PeSectionInfo* sections) {
+    if(file == nullptr) {
+        return -EINVAL;
+    }
+
+    int count = 0;
+    for(int i = 0; i < file->sectionCount; i++) {
+        count += file->sections[i].pointer != nullptr;
+    }
+    if(sections == nullptr) {
+        return count;
+    }
+
+    auto residentBytes = new size_t[file->sectionCount];
+    auto hugePageBytes = new size_t[file->sectionCount];
+    measureResidency(file, residentBytes, hugePageBytes);
+
+    auto info = sections;
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->pointer == nullptr) {
+            continue;
+        }
+
+        memcpy(info->name, section->name, sizeof(section->name));
+        info->name[sizeof(section->name)] = 0;
+        info->address = section->pointer;
+        info->size = section->size;
+        info->protection = sectionPerms(section);
+        info->residentBytes = residentBytes[i];
+        info->hugePageBytes = hugePageBytes[i];
+        info++;
+    }
+
+    delete[] residentBytes;
+    delete[] hugePageBytes;
+
+    return count;
+}
+
+int peloader_recordWorkingSet(PeFile* file) {
+    if(file == nullptr || file->workingSet == nullptr || file->sectionAllocation == nullptr) {
+        return -EINVAL;
+    }
+
+    return recordWorkingSet(file);
+}
+
 int peloader_modules(PeFile* file, const char** names) {
     if(file == nullptr) {
         return -EINVAL;
@@ -779,15 +1537,36 @@ int peloader_exports(PeFile* file, PeSymbol* symbols) {
     }
 
     auto count = file->exportCount;
-    if(symbols != nullptr) {
-        for(int i = 0; i < count; i++) {
-            auto currentIn = &file->exports[i];
-            auto currentOut = &symbols[i];
-            currentOut->name = currentIn->name;
-            currentOut->ordinal = currentIn->ordinal;
-            currentOut->address = currentIn->address;
+    if(symbols == nullptr || count == 0) {
+        return count;
+    }
+
+    // The list is built from the tables in the image. The first entry of the name table that maps to a slot names it.
+    auto table = &file->exportTable;
+    auto slotNames = new uint32_t[table->addressCount];
+    for(uint32_t i = 0; i < table->addressCount; i++) {
+        slotNames[i] = UINT32_MAX;
+    }
+    for(uint32_t i = 0; i < table->nameCount; i++) {
+        auto slot = table->ordinals[i];
+        if(slot < table->addressCount && slotNames[slot] == UINT32_MAX) {
+            slotNames[slot] = i;
+        }
+    }
+
+    auto currentOut = symbols;
+    for(uint32_t i = 0; i < table->addressCount; i++) {
+        if(table->addresses[i] == 0) {
+            continue;
         }
+
+        currentOut->name = slotNames[i] != UINT32_MAX ? resolveRva<char>(file, table->names[slotNames[i]]) : nullptr;
+        currentOut->ordinal = (int) (table->ordinalBase + i);
+        currentOut->address = exportAddress(file, i);
+        currentOut++;
     }
 
+    delete[] slotNames;
+
     return count;
 }
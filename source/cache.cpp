@@ -0,0 +1,672 @@
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+#include "cache.h"
+#include "rva.h"
+
+#define PAGE_SIZE (0x1000)
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+/**
+ * The magic at the start of every cache entry, "PECACHE" and the version of the format.
+ */
+#define CACHE_MAGIC (0x0145484341434550ULL)
+
+/**
+ * The magic at the start of every working set profile, "PEWSET" and the version of the format.
+ */
+#define WORKING_SET_MAGIC (0x0154455357455000ULL)
+
+/**
+ * The most sections a PE file can have.
+ */
+#define MAX_SECTIONS (96)
+
+/**
+ * The start of a cache entry. The section headers follow it and the image starts at the next page after them. Shared
+ * images use the same layout with the source fields left at zero.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t imageOffset;
+
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    int64_t sourceTimeNsec;
+    uint64_t sourceHash;
+
+    /**
+     * The address the image is relocated for and the lowest section address relative to it.
+     */
+    uint64_t base;
+    uint64_t sectionStart;
+    uint64_t allocationSize;
+
+    PeOptionalHeaderStd std;
+    PeOptionalHeaderWin win;
+    PeDataDir dataDirs[16];
+
+    uint32_t sectionCount;
+} CacheHeader;
+
+/**
+ * The start of a working set profile, a bitmap with a bit per page of the image follows it.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    uint64_t pageCount;
+} WorkingSetHeader;
+
+/**
+ * Hashes the contents of a file, used to check if a file with a new modification time still has the same contents.
+ * This only has to catch changes, it is not meant to stand up to anyone crafting collisions.
+ *
+ * @param data The contents of the file
+ * @param length The length of the file
+ * @return The hash of the contents
+ */
+static uint64_t hashContents(const uint8_t* data, size_t length) {
+    uint64_t hash = 0xCBF29CE484222325ULL ^ length;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    for(; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hashes the contents of an open file.
+ *
+ * @param handle The file to hash
+ * @param length The length of the file
+ * @param hash The hash of the contents
+ * @return 0 on success, <0 on error
+ */
+static int hashFile(int handle, size_t length, uint64_t* hash) {
+    if(length == 0) {
+        *hash = hashContents(nullptr, 0);
+        return 0;
+    }
+
+    auto contents = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, handle, 0);
+    if(contents == MAP_FAILED) {
+        return -errno;
+    }
+    *hash = hashContents(static_cast<const uint8_t*>(contents), length);
+    munmap(contents, length);
+    return 0;
+}
+
+/**
+ * Gets the path of the cache entry of a file. Entries are named after the device and inode of the file so a hit never
+ * has to read the file itself.
+ *
+ * @param buffer The buffer for the path
+ * @param directory The cache directory
+ * @param stat The status of the file
+ * @param suffix The suffix of the entry
+ * @return 0 on success, <0 on error
+ */
+static int entryPath(char (&buffer)[PATH_MAX], const char* directory, const struct stat64& stat, const char* suffix) {
+    auto length = snprintf(
+        buffer, sizeof(buffer), "%s/%016llx-%016llx%s", directory,
+        (unsigned long long) stat.st_dev, (unsigned long long) stat.st_ino, suffix
+    );
+    if(length < 0 || (size_t) length >= sizeof(buffer)) {
+        return -ENAMETOOLONG;
+    }
+    return 0;
+}
+
+/**
+ * Creates a uniquely named temporary file next to a path, which is renamed over the path once it is written. The name
+ * is unique per call so concurrent writes of the same entry, in this process or any other, never share a file.
+ *
+ * @param temporary Set to the path of the temporary file
+ * @param path The path the temporary file is for
+ * @return The handle of the temporary file on success, <0 on error
+ */
+static int createTemporary(char (&temporary)[PATH_MAX], const char* path) {
+    auto length = snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    if(length < 0 || (size_t) length >= sizeof(temporary)) {
+        return -ENAMETOOLONG;
+    }
+
+    auto handle = mkostemp(temporary, O_CLOEXEC);
+    if(handle == -1) {
+        return -errno;
+    }
+
+    // mkostemp only gives the owner access, entries are readable like any other file
+    if(fchmod(handle, 0644) != 0) {
+        auto result = -errno;
+        close(handle);
+        unlink(temporary);
+        return result;
+    }
+
+    return handle;
+}
+
+/**
+ * Reads from a file at an offset until everything is read.
+ *
+ * @param handle The file to read from
+ * @param buffer The buffer to read into
+ * @param length The amount to read
+ * @param offset The offset in the file
+ * @return 0 on success, <0 on error
+ */
+static int preadFully(int handle, void* buffer, size_t length, off64_t offset) {
+    auto pointer = static_cast<uint8_t*>(buffer);
+    while(length > 0) {
+        auto transferred = pread64(handle, pointer, length, offset);
+        if(transferred < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        } else if(transferred == 0) {
+            return -EIO;
+        }
+        pointer += transferred;
+        length -= transferred;
+        offset += transferred;
+    }
+    return 0;
+}
+
+/**
+ * Writes to a file at an offset until everything is written.
+ *
+ * @param handle The file to write to
+ * @param buffer The buffer to write
+ * @param length The amount to write
+ * @param offset The offset in the file
+ * @return 0 on success, <0 on error
+ */
+static int pwriteFully(int handle, const void* buffer, size_t length, off64_t offset) {
+    auto pointer = static_cast<const uint8_t*>(buffer);
+    while(length > 0) {
+        auto transferred = pwrite64(handle, pointer, length, offset);
+        if(transferred < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        }
+        pointer += transferred;
+        length -= transferred;
+        offset += transferred;
+    }
+    return 0;
+}
+
+/**
+ * Checks that a cache entry is for the current contents of the file. A changed modification time falls back to a hash
+ * of the contents, and the entry is updated to the new time when the contents match.
+ *
+ * @param file The PE file being loaded
+ * @param entry The path of the cache entry
+ * @param header The header of the cache entry
+ * @param stat The status of the file
+ * @return 0 if the entry is valid, <0 otherwise
+ */
+static int checkSource(PeFile* file, const char* entry, CacheHeader* header, const struct stat64& stat) {
+    if(header->sourceSize != (uint64_t) stat.st_size) {
+        return -ESTALE;
+    }
+    if(header->sourceTime == stat.st_mtim.tv_sec && header->sourceTimeNsec == stat.st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    uint64_t hash = 0;
+    auto result = hashFile(file->load->file.fileHandle, (size_t) stat.st_size, &hash);
+    file->load->file.ioCalls++;
+    if(result < 0) return result;
+
+    if(hash != header->sourceHash) {
+        return -ESTALE;
+    }
+
+    // Best effort, a failure only means the contents get hashed again next time
+    header->sourceTime = stat.st_mtim.tv_sec;
+    header->sourceTimeNsec = stat.st_mtim.tv_nsec;
+    auto handle = open(entry, O_WRONLY | O_CLOEXEC);
+    if(handle != -1) {
+        pwriteFully(handle, &header->sourceTime, sizeof(header->sourceTime) * 2, offsetof(CacheHeader, sourceTime));
+        close(handle);
+    }
+
+    return 0;
+}
+
+/**
+ * Checks if a page only contains zeros.
+ *
+ * @param page The page to check
+ * @return true if every byte is zero
+ */
+static bool isZeroPage(const uint8_t* page) {
+    uint64_t bits = 0;
+    for(size_t i = 0; i < PAGE_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, page + i, sizeof(word));
+        bits |= word;
+    }
+    return bits == 0;
+}
+
+/**
+ * Writes the image of a PE file as an entry. Pages that only hold zeros are skipped, they stay holes that take no space.
+ *
+ * @param file The PE file to write
+ * @param handle The file to write the entry to, it has to be empty
+ * @param header The header of the entry with the source fields set, the rest is filled in
+ * @return 0 on success, <0 on error
+ */
+static int writeEntry(PeFile* file, int handle, CacheHeader* header) {
+    if(file->sectionAllocation == nullptr || file->sectionCount > MAX_SECTIONS) {
+        return -EINVAL;
+    }
+
+    header->magic = CACHE_MAGIC;
+    header->imageOffset = (sizeof(*header) + file->sectionCount * sizeof(PeSectionHeader) + PAGE_MASK) & ~(uint64_t) PAGE_MASK;
+    header->allocationSize = file->sectionAllocationSize;
+    header->std = file->load->headers.std;
+    header->win = file->load->headers.win;
+    memcpy(header->dataDirs, file->load->dataDirs, sizeof(header->dataDirs));
+    header->sectionCount = (uint32_t) file->sectionCount;
+
+    header->sectionStart = sectionStart(file);
+    header->base = reinterpret_cast<uintptr_t>(file->sectionAllocation) - header->sectionStart;
+
+    if(ftruncate64(handle, (off64_t) (header->imageOffset + header->allocationSize)) != 0) {
+        return -errno;
+    }
+
+    auto result = pwriteFully(handle, header, sizeof(*header), 0);
+    for(int i = 0; result == 0 && i < file->sectionCount; i++) {
+        result = pwriteFully(
+            handle, &file->load->sectionHeaders[i], sizeof(PeSectionHeader),
+            (off64_t) (sizeof(*header) + i * sizeof(PeSectionHeader))
+        );
+    }
+
+    auto image = static_cast<const uint8_t*>(file->sectionAllocation);
+    size_t offset = 0;
+    while(result == 0 && offset < header->allocationSize) {
+        if(isZeroPage(image + offset)) {
+            offset += PAGE_SIZE;
+            continue;
+        }
+
+        auto end = offset + PAGE_SIZE;
+        while(end < header->allocationSize && !isZeroPage(image + end)) {
+            end += PAGE_SIZE;
+        }
+        result = pwriteFully(handle, image + offset, end - offset, (off64_t) (header->imageOffset + offset));
+        offset = end;
+    }
+
+    return result;
+}
+
+/**
+ * Reads and checks the header and the section headers of an entry.
+ *
+ * @param file The PE file being loaded
+ * @param handle The entry to read
+ * @param header The header of the entry
+ * @param sectionHeaders The section headers of the entry
+ * @return 0 on success, <0 if the entry is invalid or on error
+ */
+static int readEntry(PeFile* file, int handle, CacheHeader* header, PeSectionHeader (&sectionHeaders)[MAX_SECTIONS]) {
+    struct stat64 entryStat;
+    file->load->file.ioCalls += 3;
+    auto result = preadFully(handle, header, sizeof(*header), 0);
+    if(result == 0 && fstat64(handle, &entryStat) != 0) {
+        result = -errno;
+    }
+    if(result == 0 && (
+        header->magic != CACHE_MAGIC ||
+        header->sectionCount > MAX_SECTIONS ||
+        header->imageOffset < sizeof(*header) + header->sectionCount * sizeof(PeSectionHeader) ||
+        (header->imageOffset & PAGE_MASK) != 0 ||
+        header->allocationSize == 0 ||
+        header->imageOffset + header->allocationSize > (uint64_t) entryStat.st_size
+    )) {
+        result = -EINVAL;
+    }
+    if(result == 0) {
+        result = preadFully(handle, sectionHeaders, header->sectionCount * sizeof(PeSectionHeader), sizeof(*header));
+    }
+    for(uint32_t i = 0; result == 0 && i < header->sectionCount; i++) {
+        auto section = &sectionHeaders[i];
+        if(
+            section->virtualSize != 0 && (
+                section->virtualAddress < header->sectionStart ||
+                section->virtualAddress - header->sectionStart + (uint64_t) section->virtualSize > header->allocationSize
+            )
+        ) {
+            result = -EINVAL;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Maps the image of an entry at the address it was relocated for when that address is free, otherwise anywhere.
+ *
+ * @param file The PE file to load the image into
+ * @param handle The entry to map
+ * @param header The header of the entry
+ * @param sectionHeaders The section headers of the entry
+ * @param relocateFrom Set to the address the image is relocated for if it has to be relocated again, 0 otherwise
+ * @return 0 on success, <0 on error
+ */
+static int mapEntry(PeFile* file, int handle, const CacheHeader* header, const PeSectionHeader* sectionHeaders, uint64_t* relocateFrom) {
+    auto address = reinterpret_cast<void*>(header->base + header->sectionStart);
+    auto allocation = mmap(
+        address,
+        header->allocationSize,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+        handle,
+        (off64_t) header->imageOffset
+    );
+    if(allocation == MAP_FAILED && errno == EEXIST) {
+        allocation = mmap(nullptr, header->allocationSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, handle, (off64_t) header->imageOffset);
+    }
+    file->load->file.ioCalls++;
+    if(allocation == MAP_FAILED) {
+        return -errno;
+    }
+
+    file->load->headers.std = header->std;
+    file->load->headers.win = header->win;
+    memcpy(file->load->dataDirs, header->dataDirs, sizeof(file->load->dataDirs));
+    file->sectionAllocation = allocation;
+    file->sectionAllocationSize = header->allocationSize;
+
+    setSections(file, sectionHeaders, (int) header->sectionCount);
+    auto pointer = reinterpret_cast<uintptr_t>(allocation);
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->size != 0) {
+            section->pointer = reinterpret_cast<void*>(pointer + section->virtualAddress - header->sectionStart);
+        }
+    }
+    buildRvaIndex(file);
+
+    *relocateFrom = allocation == address ? 0 : header->base;
+    file->stats.preferredBase = allocation == address && header->base == header->win.imageBase;
+
+    return 0;
+}
+
+/**
+ * Loads the image of a PE file from the cache. The image is mapped at the address it was relocated for when that address
+ * is free, otherwise it is mapped anywhere and the caller has to relocate it again.
+ *
+ * @param file The PE file to load the image into
+ * @param directory The cache directory
+ * @param stat The status of the PE file
+ * @param relocateFrom Set to the address the image is relocated for if it has to be relocated again, 0 otherwise
+ * @return 0 on success, <0 on a miss or error
+ */
+int loadCachedImage(PeFile* file, const char* directory, const struct stat64& stat, uint64_t* relocateFrom) {
+    if(!S_ISREG(stat.st_mode)) {
+        return -EINVAL;
+    }
+
+    char entry[PATH_MAX];
+    auto result = entryPath(entry, directory, stat, ".pecache");
+    if(result < 0) return result;
+
+    auto handle = open(entry, O_RDONLY | O_CLOEXEC);
+    if(handle == -1) {
+        return -errno;
+    }
+
+    CacheHeader header;
+    PeSectionHeader sectionHeaders[MAX_SECTIONS];
+    result = readEntry(file, handle, &header, sectionHeaders);
+    if(result == 0) {
+        result = checkSource(file, entry, &header, stat);
+    }
+    if(result == 0) {
+        result = mapEntry(file, handle, &header, sectionHeaders, relocateFrom);
+    }
+    close(handle);
+
+    return result;
+}
+
+/**
+ * Writes the relocated image of a PE file to the cache. The entry is written to a temporary file first and renamed into
+ * place, so concurrent loads never see a partial entry.
+ *
+ * @param file The PE file to cache, it has to be opened from a mapped file
+ * @param directory The cache directory
+ * @return 0 on success, <0 on error
+ */
+int storeCachedImage(PeFile* file, const char* directory) {
+    if(file->load->file.fileType != TYPE_MAPPED) {
+        return -EINVAL;
+    }
+
+    struct stat64 stat;
+    if(fstat64(file->load->file.mappedFile.fileHandle, &stat) != 0) {
+        return -errno;
+    }
+
+    CacheHeader header = {};
+    header.sourceSize = (uint64_t) stat.st_size;
+    header.sourceTime = stat.st_mtim.tv_sec;
+    header.sourceTimeNsec = stat.st_mtim.tv_nsec;
+    header.sourceHash = hashContents(static_cast<const uint8_t*>(file->load->file.mappedFile.pointer), file->load->file.mappedFile.length);
+
+    char entry[PATH_MAX];
+    char temporary[PATH_MAX];
+    auto result = entryPath(entry, directory, stat, ".pecache");
+    if(result < 0) return result;
+
+    auto handle = createTemporary(temporary, entry);
+    if(handle < 0) return handle;
+
+    result = writeEntry(file, handle, &header);
+    if(close(handle) != 0 && result == 0) {
+        result = -errno;
+    }
+    if(result == 0 && rename(temporary, entry) != 0) {
+        result = -errno;
+    }
+    if(result < 0) {
+        unlink(temporary);
+    }
+
+    return result;
+}
+
+/**
+ * Writes the image of a PE file to an empty file in the same format as a cache entry, without anything about where the
+ * image came from.
+ *
+ * @param file The PE file to write
+ * @param handle The file to write to
+ * @param imageOffset Set to the offset of the image in the file
+ * @return 0 on success, <0 on error
+ */
+int writeImageEntry(PeFile* file, int handle, uint64_t* imageOffset) {
+    CacheHeader header = {};
+    auto result = writeEntry(file, handle, &header);
+    if(result < 0) return result;
+
+    *imageOffset = header.imageOffset;
+    return 0;
+}
+
+/**
+ * Maps the image of a file written by writeImageEntry, like a cache hit.
+ *
+ * @param file The PE file to load the image into
+ * @param handle The file to map
+ * @param imageOffset Set to the offset of the image in the file
+ * @param relocateFrom Set to the address the image is relocated for if it has to be relocated again, 0 otherwise
+ * @return 0 on success, <0 on error
+ */
+int mapImageEntry(PeFile* file, int handle, uint64_t* imageOffset, uint64_t* relocateFrom) {
+    CacheHeader header;
+    PeSectionHeader sectionHeaders[MAX_SECTIONS];
+    auto result = readEntry(file, handle, &header, sectionHeaders);
+    if(result == 0) {
+        result = mapEntry(file, handle, &header, sectionHeaders, relocateFrom);
+    }
+    if(result < 0) return result;
+
+    *imageOffset = header.imageOffset;
+    return 0;
+}
+
+/**
+ * Gets the path of the working set profile of a file.
+ *
+ * @param buffer The buffer for the path
+ * @param workingSet The working set of the file
+ * @param suffix The suffix of the profile
+ * @return 0 on success, <0 on error
+ */
+static int profilePath(char (&buffer)[PATH_MAX], const PeWorkingSet* workingSet, const char* suffix) {
+    struct stat64 stat = {};
+    stat.st_dev = (dev_t) workingSet->device;
+    stat.st_ino = (ino64_t) workingSet->inode;
+    return entryPath(buffer, workingSet->directory, stat, suffix);
+}
+
+/**
+ * Sets up the working set profile of a PE file that is opened from disk.
+ *
+ * @param file The PE file
+ * @param directory The cache directory
+ * @param stat The status of the PE file
+ * @return 0 on success, <0 on error
+ */
+int openWorkingSet(PeFile* file, const char* directory, const struct stat64& stat) {
+    auto length = strlen(directory);
+    auto workingSet = new PeWorkingSet();
+    workingSet->directory = new char[length + 1];
+    memcpy(workingSet->directory, directory, length + 1);
+    workingSet->device = (uint64_t) stat.st_dev;
+    workingSet->inode = (uint64_t) stat.st_ino;
+    workingSet->size = (uint64_t) stat.st_size;
+    workingSet->time = (int64_t) stat.st_mtim.tv_sec * 1000000000 + stat.st_mtim.tv_nsec;
+    file->workingSet = workingSet;
+
+    return 0;
+}
+
+/**
+ * Reads the recorded working set of a PE file.
+ *
+ * @param workingSet The working set of the file
+ * @param pages The bitmap to read into, a bit per page
+ * @param pageCount The number of pages of the image
+ * @return 0 on success, <0 if there is no profile for this image or on error
+ */
+int loadWorkingSet(const PeWorkingSet* workingSet, uint8_t* pages, size_t pageCount) {
+    char path[PATH_MAX];
+    auto result = profilePath(path, workingSet, ".peprofile");
+    if(result < 0) return result;
+
+    auto handle = open(path, O_RDONLY | O_CLOEXEC);
+    if(handle == -1) {
+        return -errno;
+    }
+
+    WorkingSetHeader header;
+    result = preadFully(handle, &header, sizeof(header), 0);
+    if(result == 0 && (
+        header.magic != WORKING_SET_MAGIC ||
+        header.sourceSize != workingSet->size ||
+        header.sourceTime != workingSet->time ||
+        header.pageCount != pageCount
+    )) {
+        result = -ESTALE;
+    }
+    if(result == 0) {
+        result = preadFully(handle, pages, (pageCount + 7) / 8, sizeof(header));
+    }
+    close(handle);
+
+    return result;
+}
+
+/**
+ * Writes the working set of a PE file, replacing the previous profile.
+ *
+ * @param workingSet The working set of the file
+ * @param pages The bitmap of the pages in the working set, a bit per page
+ * @param pageCount The number of pages of the image
+ * @return 0 on success, <0 on error
+ */
+int storeWorkingSet(const PeWorkingSet* workingSet, const uint8_t* pages, size_t pageCount) {
+    char path[PATH_MAX];
+    char temporary[PATH_MAX];
+    auto result = profilePath(path, workingSet, ".peprofile");
+    if(result < 0) return result;
+
+    auto handle = createTemporary(temporary, path);
+    if(handle < 0) return handle;
+
+    WorkingSetHeader header = {};
+    header.magic = WORKING_SET_MAGIC;
+    header.sourceSize = workingSet->size;
+    header.sourceTime = workingSet->time;
+    header.pageCount = pageCount;
+    result = pwriteFully(handle, &header, sizeof(header), 0);
+    if(result == 0) {
+        result = pwriteFully(handle, pages, (pageCount + 7) / 8, sizeof(header));
+    }
+    if(close(handle) != 0 && result == 0) {
+        result = -errno;
+    }
+    if(result == 0 && rename(temporary, path) != 0) {
+        result = -errno;
+    }
+    if(result < 0) {
+        unlink(temporary);
+    }
+
+    return result;
+}
+
+/**
+ * Frees the working set of a PE file.
+ *
+ * @param file The PE file
+ */
+void freeWorkingSet(PeFile* file) {
+    if(file->workingSet != nullptr) {
+        delete[] file->workingSet->directory;
+        delete file->workingSet;
+        file->workingSet = nullptr;
+    }
+}
@@ -0,0 +1,628 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+}
+
+#include "demand.h"
+#include "relocate.h"
+#include "residency.h"
+#include "rva.h"
+
+#define PAGE_SIZE (0x1000)
+
+/**
+ * The number of pages that are filled together, the clusters are aligned to their size. Like the fault-around of the
+ * kernel for files this saves a trip through the pager for the pages next to the one that was touched.
+ */
+#define DEMAND_CLUSTER_PAGES (16)
+
+/**
+ * The bytes of the image that are read on either side of the pages that are filled, enough for a relocated value that
+ * is split between two pages.
+ */
+#define DEMAND_MARGIN (sizeof(uint64_t))
+
+/**
+ * The most page faults that the pager takes at once.
+ */
+#define DEMAND_BATCH (16)
+
+/**
+ * The number of pager threads. Every thread serves one image at a time, so a slow file only holds up one of them.
+ */
+#define DEMAND_THREADS (4)
+
+/**
+ * The bytes of the buffer of a pager thread, one page larger than a cluster on either side for the margins.
+ */
+#define DEMAND_BUFFER_SIZE ((DEMAND_CLUSTER_PAGES + 2) * PAGE_SIZE)
+
+/**
+ * A part of the image that comes from the file, the rest of the image is zero.
+ */
+typedef struct {
+    uint32_t rva;
+    uint32_t length;
+    size_t offset;
+} DemandRange;
+
+struct PeDemandImage {
+    /**
+     * The userfaultfd that the allocation is registered with.
+     */
+    int handle;
+
+    /**
+     * Identifies the image in the events of the pager, an image can be closed after its event was taken.
+     */
+    uint64_t id;
+
+    /**
+     * The source of the image, it stays open for as long as the image does.
+     */
+    File file;
+    DemandRange* ranges;
+    int rangeCount;
+
+    uintptr_t allocation;
+    size_t size;
+    uint32_t low;
+
+    /**
+     * A copy of the relocation table and its index, the table is nullptr when the image does not need relocations.
+     */
+    uint8_t* table;
+    RelocationPageIndex index;
+    int64_t delta;
+
+    /**
+     * A bit per cluster of pages that were filled. It is only written by the thread that serves the image, but
+     * prepareFork reads it at any time.
+     */
+    uint8_t* clusters;
+    size_t clusterCount;
+
+    /**
+     * The process that the image was loaded in, the child of a fork gets a copy that it can only free.
+     */
+    pid_t process;
+
+    /**
+     * Set while a pager thread serves the image, an image that is closed meanwhile is freed by that thread.
+     */
+    bool serving;
+    bool closed;
+};
+
+/**
+ * The threads that fill the pages of every demand paged image of the process, they wait for the page faults of all of
+ * them with epoll. Every image is armed for one event at a time, so only one thread serves it.
+ */
+typedef struct {
+    int epoll;
+
+    /**
+     * The buffers the pages are prepared in, one per thread.
+     */
+    uint8_t* buffers;
+
+    std::vector<PeDemandImage*> images;
+    uint64_t nextId;
+
+    /**
+     * Bumped for every image that is added, see prepareFork.
+     */
+    uint64_t generation;
+} DemandPager;
+
+/**
+ * Guards the pager and the list of images. The pager threads only hold it to take and return an image, never while
+ * they read its file. The pager is never freed, it is started by the first demand paged image and the threads run
+ * until the process exits.
+ */
+static std::mutex pagerMutex;
+static DemandPager* pager;
+
+/**
+ * Reads a part of an image the way it is laid out in memory, before the relocations are applied.
+ *
+ * @param image The image to read
+ * @param rva The RVA to start at
+ * @param buffer The buffer to read into
+ * @param length The number of bytes to read
+ * @return 0 on success, <0 on error
+ */
+static int readImage(PeDemandImage* image, uint64_t rva, uint8_t* buffer, size_t length) {
+    memset(buffer, 0, length);
+
+    for(int i = 0; i < image->rangeCount; i++) {
+        auto range = &image->ranges[i];
+        auto start = std::max(rva, (uint64_t) range->rva);
+        auto end = std::min(rva + length, (uint64_t) range->rva + range->length);
+        if(start >= end) {
+            continue;
+        }
+
+        auto result = readFully(&image->file, range->offset + (start - range->rva), buffer + (start - rva), end - start);
+        if(result < 0) return result;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks if a cluster of pages of an image was filled.
+ *
+ * @param image The image
+ * @param cluster The index of the cluster
+ * @return true if every page of the cluster was filled once
+ */
+static inline bool isClusterFilled(PeDemandImage* image, size_t cluster) {
+    return (__atomic_load_n(&image->clusters[cluster / 8], __ATOMIC_RELAXED) & (1 << (cluster % 8))) != 0;
+}
+
+/**
+ * Fills the cluster of pages around a page fault, pages of the cluster that are already there are skipped. When the
+ * cluster was filled before only the page itself is filled again, it is either being filled by a fault that came in at
+ * the same time or it was dropped with madvise.
+ *
+ * A page that can not be read from the file fails the fault the way the kernel fails one of a mapped file, the thread
+ * that touched it gets SIGBUS. The page stays missing, a thread that handles the signal and touches it again has it
+ * read again.
+ *
+ * @param image The image that faulted
+ * @param fault The page fault
+ * @param buffer The buffer of the pager thread
+ */
+static void fillPages(PeDemandImage* image, const uffd_msg* fault, uint8_t* buffer) {
+    auto pageCount = image->size / PAGE_SIZE;
+    auto page = (fault->arg.pagefault.address - image->allocation) / PAGE_SIZE;
+    auto cluster = page / DEMAND_CLUSTER_PAGES;
+
+    size_t first = page;
+    size_t end = page + 1;
+    auto whole = !isClusterFilled(image, cluster);
+    if(whole) {
+        first = cluster * DEMAND_CLUSTER_PAGES;
+        end = std::min(first + DEMAND_CLUSTER_PAGES, pageCount);
+    }
+
+    // The pages start one page into the buffer so they are page aligned, the margins are right before and after them
+    uint64_t start = image->low + first * PAGE_SIZE;
+    auto length = (end - first) * PAGE_SIZE;
+    auto before = std::min(start, (uint64_t) DEMAND_MARGIN);
+    auto pages = buffer + PAGE_SIZE;
+    if(readImage(image, start - before, pages - before, before + length + DEMAND_MARGIN) < 0) {
+        syscall(SYS_tgkill, image->process, (pid_t) fault->arg.pagefault.feat.ptid, SIGBUS);
+        return;
+    }
+    if(image->table != nullptr) {
+        RelocationTarget window;
+        window.image = reinterpret_cast<uintptr_t>(pages) - start;
+        window.low = (uint32_t) (start - before);
+        window.high = (uint32_t) (start + length + DEMAND_MARGIN);
+        window.delta = image->delta;
+        relocateWindow(&window, image->table, &image->index);
+    }
+
+    bool filled = false;
+    bool single = false;
+    auto current = first;
+    while(current < end) {
+        uffdio_copy copy = {};
+        copy.dst = image->allocation + current * PAGE_SIZE;
+        copy.src = reinterpret_cast<uintptr_t>(pages + (current - first) * PAGE_SIZE);
+        copy.len = single ? PAGE_SIZE : (end - current) * PAGE_SIZE;
+        if(ioctl(image->handle, UFFDIO_COPY, &copy) == 0) {
+            auto copied = copy.len / PAGE_SIZE;
+            filled |= page >= current && page < current + copied;
+            current += copied;
+            continue;
+        }
+
+        // A copy stops at the first page that is already there, and it can not cross into another mapping, which the
+        // image is split into once the permissions are applied
+        if(errno == EAGAIN && copy.copy > 0) {
+            filled |= page >= current && page < current + copy.copy / PAGE_SIZE;
+            current += copy.copy / PAGE_SIZE;
+        } else if(errno == EEXIST) {
+            current++;
+        } else if(errno == ENOENT && !single) {
+            single = true;
+        } else {
+            break;
+        }
+    }
+    if(whole && current == end) {
+        __atomic_fetch_or(&image->clusters[cluster / 8], (uint8_t) (1 << (cluster % 8)), __ATOMIC_RELAXED);
+    }
+
+    // The faulting thread is only woken by a copy that covers its page
+    if(!filled) {
+        uffdio_range range;
+        range.start = image->allocation + page * PAGE_SIZE;
+        range.len = PAGE_SIZE;
+        ioctl(image->handle, UFFDIO_WAKE, &range);
+    }
+}
+
+/**
+ * Fills the pages of every page fault of an image that is waiting.
+ *
+ * @param image The image to serve
+ * @param buffer The buffer of the pager thread
+ */
+static void serveFaults(PeDemandImage* image, uint8_t* buffer) {
+    uffd_msg messages[DEMAND_BATCH];
+    while(true) {
+        auto length = read(image->handle, messages, sizeof(messages));
+        if(length <= 0) {
+            return;
+        }
+
+        for(size_t i = 0; i < (size_t) length / sizeof(uffd_msg); i++) {
+            if(messages[i].event == UFFD_EVENT_PAGEFAULT) {
+                fillPages(image, &messages[i], buffer);
+            }
+        }
+    }
+}
+
+/**
+ * Frees everything of an image but the structure itself.
+ *
+ * @param image The image to release
+ */
+static void releaseImage(PeDemandImage* image) {
+    close(image->handle);
+    closeFile(&image->file);
+    delete[] image->ranges;
+    delete[] image->table;
+    freeRelocationPageIndex(&image->index);
+    delete[] image->clusters;
+}
+
+/**
+ * The loop of a pager thread. The image of an event is looked up by its id, it can be closed by then.
+ *
+ * @param current The pager
+ * @param buffer The buffer of the thread
+ */
+static void runPager(DemandPager* current, uint8_t* buffer) {
+    while(true) {
+        epoll_event event;
+        if(epoll_wait(current->epoll, &event, 1, -1) != 1) {
+            continue;
+        }
+
+        PeDemandImage* image = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(pagerMutex);
+            for(auto candidate : current->images) {
+                if(candidate->id == event.data.u64) {
+                    image = candidate;
+                    image->serving = true;
+                    break;
+                }
+            }
+        }
+        if(image == nullptr) {
+            continue;
+        }
+
+        serveFaults(image, buffer);
+
+        std::lock_guard<std::mutex> lock(pagerMutex);
+        image->serving = false;
+        if(image->closed) {
+            releaseImage(image);
+            delete image;
+            continue;
+        }
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        epoll_ctl(current->epoll, EPOLL_CTL_MOD, image->handle, &event);
+    }
+}
+
+/**
+ * Fills the pages of the demand paged images that are still missing before the process forks. The child gets a copy of
+ * the memory of the parent but not its userfaultfd registrations, a page that is still missing would be zero in the
+ * child. Only the clusters that were never filled are faulted in, images that were touched everywhere cost nothing. The
+ * pager is locked until the fork is done, so no image can be added or closed in between.
+ */
+static void prepareFork() {
+    pagerMutex.lock();
+    while(pager != nullptr) {
+        auto generation = pager->generation;
+        std::vector<std::pair<uintptr_t, size_t>> ranges;
+        for(auto image : pager->images) {
+            auto clusterSize = (size_t) DEMAND_CLUSTER_PAGES * PAGE_SIZE;
+            for(size_t cluster = 0; cluster < image->clusterCount; cluster++) {
+                if(isClusterFilled(image, cluster)) {
+                    continue;
+                }
+
+                auto start = image->allocation + cluster * clusterSize;
+                auto length = std::min(clusterSize, image->size - cluster * clusterSize);
+                if(!ranges.empty() && ranges.back().first + ranges.back().second == start) {
+                    ranges.back().second += length;
+                } else {
+                    ranges.emplace_back(start, length);
+                }
+            }
+        }
+
+        // The pager needs the lock to fill the pages
+        pagerMutex.unlock();
+        for(auto& range : ranges) {
+            populate(range.first, range.second);
+        }
+        pagerMutex.lock();
+
+        if(pager->generation == generation) {
+            break;
+        }
+    }
+}
+
+static void parentForked() {
+    pagerMutex.unlock();
+}
+
+/**
+ * The pager threads only exist in the parent, the child starts its own when it needs them. The images the child got a
+ * copy of are complete already.
+ */
+static void childForked() {
+    if(pager != nullptr) {
+        close(pager->epoll);
+        pager = nullptr;
+    }
+    pagerMutex.unlock();
+}
+
+/**
+ * Gets the pager of the process, starting it if there is none. The pager lock has to be held.
+ *
+ * @return The pager or nullptr on error
+ */
+static DemandPager* startPager() {
+    if(pager != nullptr) {
+        return pager;
+    }
+
+    static bool forkHandlers = false;
+    if(!forkHandlers) {
+        if(pthread_atfork(prepareFork, parentForked, childForked) != 0) {
+            return nullptr;
+        }
+        forkHandlers = true;
+    }
+
+    auto epoll = epoll_create1(EPOLL_CLOEXEC);
+    auto buffers = mmap(
+        nullptr,
+        DEMAND_THREADS * DEMAND_BUFFER_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE,
+        -1,
+        0
+    );
+    if(epoll == -1 || buffers == MAP_FAILED) {
+        if(epoll != -1) close(epoll);
+        if(buffers != MAP_FAILED) munmap(buffers, DEMAND_THREADS * DEMAND_BUFFER_SIZE);
+        return nullptr;
+    }
+
+    auto created = new DemandPager();
+    created->epoll = epoll;
+    created->buffers = static_cast<uint8_t*>(buffers);
+    for(int i = 0; i < DEMAND_THREADS; i++) {
+        auto buffer = created->buffers + i * DEMAND_BUFFER_SIZE;
+        std::thread([created, buffer]() { runPager(created, buffer); }).detach();
+    }
+
+    pager = created;
+    return pager;
+}
+
+/**
+ * Opens a userfaultfd. Without the capability for it a process can still get one from /dev/userfaultfd when it has
+ * access to that.
+ *
+ * @return The handle or -1 on error
+ */
+static int openUserfault() {
+    int handle = -1;
+#ifdef SYS_userfaultfd
+    handle = (int) syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+#endif
+#ifdef USERFAULTFD_IOC_NEW
+    if(handle == -1) {
+        auto device = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+        if(device != -1) {
+            handle = ioctl(device, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+            close(device);
+        }
+    }
+#endif
+    return handle;
+}
+
+/**
+ * Reads the relocation table of an image and indexes it by page, since the table itself is in the image it has to be
+ * read from the file.
+ *
+ * @param file The PE file
+ * @param image The image of the file
+ * @return 0 on success, -ENOTSUP if the table can not be applied by page, <0 on error
+ */
+static int loadRelocations(PeFile* file, PeDemandImage* image) {
+    auto dataDir = &file->load->dataDirs[BASE_RELOCATION_TABLE_DIR];
+    auto tableSection = dataDir->virtualAddress != 0 ? resolveRvaSection(file, dataDir->virtualAddress) : nullptr;
+    if(tableSection == nullptr) {
+        return 0;
+    }
+
+    RelocationTarget target;
+    target.image = image->allocation - image->low;
+    target.low = image->low;
+    target.high = (uint32_t) (image->low + image->size);
+    target.delta = (int64_t) (target.image - file->load->headers.win.imageBase);
+    if(target.delta == 0) {
+        return 0;
+    }
+
+    auto size = std::min(
+        (size_t) dataDir->size,
+        (size_t) (tableSection->virtualAddress + tableSection->size - dataDir->virtualAddress)
+    );
+    image->table = new uint8_t[size];
+    image->delta = target.delta;
+    auto result = readImage(image, dataDir->virtualAddress, image->table, size);
+    if(result < 0) return result;
+
+    return indexRelocationPages(&target, image->table, size, &image->index);
+}
+
+/**
+ * Registers the allocation of a PE file with userfaultfd so its pages are filled from the file when they are first
+ * touched, instead of reading the sections. The relocations of every page are applied when it is filled. The sections
+ * have to be placed but not read yet, the file is taken over from the PE file.
+ *
+ * @param file The PE file
+ * @return 0 on success, -ENOTSUP if the image can not be demand paged and has to be read, <0 on error
+ */
+int startDemandPaging(PeFile* file) {
+    auto handle = openUserfault();
+    if(handle == -1) {
+        return -ENOTSUP;
+    }
+
+    // The thread of a fault is needed to fail it
+    uffdio_api api = {};
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_THREAD_ID;
+    if(ioctl(handle, UFFDIO_API, &api) != 0) {
+        close(handle);
+        return -ENOTSUP;
+    }
+
+    auto image = new PeDemandImage();
+    image->handle = handle;
+    image->file = file->load->file;
+    image->allocation = reinterpret_cast<uintptr_t>(file->sectionAllocation);
+    image->size = file->sectionAllocationSize;
+    image->low = sectionStart(file);
+    image->process = getpid();
+
+    image->clusterCount = (image->size / PAGE_SIZE + DEMAND_CLUSTER_PAGES - 1) / DEMAND_CLUSTER_PAGES;
+    image->clusters = new uint8_t[(image->clusterCount + 7) / 8]();
+    image->ranges = new DemandRange[file->sectionCount];
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        auto header = &file->load->sectionHeaders[i];
+        if(section->size == 0 || header->pointerToRawData == 0) {
+            continue;
+        }
+
+        auto range = &image->ranges[image->rangeCount++];
+        range->rva = section->virtualAddress;
+        range->length = (uint32_t) std::min((size_t) header->sizeOfRawData, section->size);
+        range->offset = header->pointerToRawData;
+    }
+
+    auto result = file->stats.preferredBase ? 0 : loadRelocations(file, image);
+    if(result == 0) {
+        uffdio_register registration = {};
+        registration.range.start = image->allocation;
+        registration.range.len = image->size;
+        registration.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if(ioctl(handle, UFFDIO_REGISTER, &registration) != 0) {
+            result = -ENOTSUP;
+        }
+    }
+
+    if(result == 0) {
+        std::lock_guard<std::mutex> lock(pagerMutex);
+        auto current = startPager();
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        if(current != nullptr) {
+            image->id = current->nextId++;
+            event.data.u64 = image->id;
+        }
+        if(current == nullptr || epoll_ctl(current->epoll, EPOLL_CTL_ADD, handle, &event) != 0) {
+            result = -ENOTSUP;
+        } else {
+            current->images.push_back(image);
+            current->generation++;
+        }
+    }
+
+    // Closing the userfaultfd drops the registration, the sections are read into the allocation instead
+    if(result < 0) {
+        image->file.fileType = TYPE_CLOSED;
+        releaseImage(image);
+        delete image;
+        return result;
+    }
+
+    // Pages are copied out of the file once, reading them through a mapping would keep them resident a second time
+    unmapFile(&image->file);
+    file->load->file.fileType = TYPE_CLOSED;
+    file->demand = image;
+    file->stats.demandPaged = 1;
+    return 0;
+}
+
+/**
+ * Stops filling the pages of a PE file, before its allocation is unmapped.
+ *
+ * @param file The PE file
+ */
+void stopDemandPaging(PeFile* file) {
+    auto image = file->demand;
+    if(image == nullptr) {
+        return;
+    }
+    file->demand = nullptr;
+
+    // A child of a fork only has a copy of the image, the pager of the parent does not know about it
+    if(image->process != getpid()) {
+        releaseImage(image);
+        delete image;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(pagerMutex);
+    epoll_ctl(pager->epoll, EPOLL_CTL_DEL, image->handle, nullptr);
+    auto& images = pager->images;
+    images.erase(std::find(images.begin(), images.end(), image));
+
+    // The thread that serves the image frees it once it is done
+    image->closed = true;
+    if(!image->serving) {
+        releaseImage(image);
+        delete image;
+    }
+}
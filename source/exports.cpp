@@ -0,0 +1,228 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "exports.h"
+#include "rva.h"
+
+// Marks an unused slot in the export index
+#define EMPTY_SLOT (UINT32_MAX)
+
+/**
+ * Hashes an export name, this is 32 bit FNV-1a.
+ *
+ * @param name The name to hash
+ * @return The hash of the name
+ */
+static uint32_t hashName(const char* name) {
+    uint32_t hash = 0x811C9DC5;
+    for(auto current = reinterpret_cast<const uint8_t*>(name); *current != 0; current++) {
+        hash ^= *current;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+/**
+ * Gets the number of slots of the export name index for a number of names. The table is kept at most half full so probe
+ * sequences stay short.
+ *
+ * @param nameCount The number of names to index
+ * @return The number of slots, always a power of two
+ */
+uint32_t exportIndexCapacity(uint32_t nameCount) {
+    uint32_t capacity = 1;
+    while(capacity < (uint64_t) nameCount * 2 && capacity < UINT32_C(0x80000000)) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/**
+ * Builds an open addressing hash table over the names of the exports of a PE file. Every entry of the name table is
+ * indexed so aliases of the same export are found.
+ *
+ * @param file The file to index
+ * @param entries The slots of the index, exportIndexCapacity of the name count of them
+ * @return 0 on success, <0 on error
+ */
+int buildExportIndex(PeFile* file, PeExportIndexEntry* entries) {
+    auto table = &file->exportTable;
+
+    auto capacity = exportIndexCapacity(table->nameCount);
+    for(uint32_t i = 0; i < capacity; i++) {
+        entries[i].index = EMPTY_SLOT;
+    }
+
+    auto mask = capacity - 1;
+    for(uint32_t i = 0; i < table->nameCount; i++) {
+        auto index = table->ordinals[i];
+        auto name = resolveRva<char>(file, table->names[i]);
+        if(name == nullptr || index >= table->addressCount) {
+            continue;
+        }
+
+        auto hash = hashName(name);
+        auto slot = hash & mask;
+        while(entries[slot].index != EMPTY_SLOT) {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot].hash = hash;
+        entries[slot].index = i;
+    }
+
+    file->exportIndex.entries = entries;
+    file->exportIndex.mask = mask;
+
+    return 0;
+}
+
+/**
+ * Finds the position of a name in the name table of a PE file using the export name index.
+ *
+ * @param file The file to search
+ * @param name The name of the export
+ * @return The position in the name table, or -1 if not found
+ */
+static int64_t findIndexedName(PeFile* file, const char* name) {
+    auto entries = file->exportIndex.entries;
+    if(entries == nullptr) {
+        return -1;
+    }
+
+    auto table = &file->exportTable;
+    auto hash = hashName(name);
+    auto mask = file->exportIndex.mask;
+    for(auto slot = hash & mask; entries[slot].index != EMPTY_SLOT; slot = (slot + 1) & mask) {
+        if(entries[slot].hash != hash) {
+            continue;
+        }
+
+        auto index = entries[slot].index;
+        if(strcmp(name, resolveRva<char>(file, table->names[index])) == 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Finds the position of a name in the name table of a PE file by binary searching it in place, the PE format requires
+ * the table to be sorted.
+ *
+ * @param file The file to search
+ * @param name The name of the export
+ * @return The position in the name table, or -1 if not found
+ */
+static int64_t findNativeName(PeFile* file, const char* name) {
+    auto table = &file->exportTable;
+
+    uint32_t low = 0;
+    uint32_t high = table->nameCount;
+    while(low < high) {
+        auto middle = low + (high - low) / 2;
+        auto current = resolveRva<char>(file, table->names[middle]);
+        if(current == nullptr) {
+            return -1;
+        }
+
+        auto comparison = strcmp(name, current);
+        if(comparison == 0) {
+            return middle;
+        } else if(comparison < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Maps a position in the name table to the slot in the export address table. The name table and the address table are
+ * not in the same order, the ordinal table maps between them.
+ *
+ * @param file The file that owns the tables
+ * @param nameIndex The position in the name table or -1
+ * @return The slot in the export address table, or -1 if not valid
+ */
+static int64_t nameSlot(PeFile* file, int64_t nameIndex) {
+    if(nameIndex < 0) {
+        return -1;
+    }
+
+    auto slot = file->exportTable.ordinals[nameIndex];
+    if(slot >= file->exportTable.addressCount) {
+        return -1;
+    }
+    return slot;
+}
+
+/**
+ * Finds the address table slot of an export by name, using the lookup method that the file was opened with.
+ *
+ * @param file The file to search
+ * @param name The name of the export
+ * @return The slot in the export address table, or -1 if not found
+ */
+int64_t findExportSlot(PeFile* file, const char* name) {
+    auto nameIndex = file->exportLookup == PELOADER_EXPORT_LOOKUP_NATIVE ?
+        findNativeName(file, name) :
+        findIndexedName(file, name);
+    return nameSlot(file, nameIndex);
+}
+
+/**
+ * Finds the address table slots of many exports at once, ordinals are preferred over names like findOrdinalSlot and
+ * findExportSlot. The lookup method is picked once for the whole batch instead of once per symbol.
+ *
+ * @param file The file to search
+ * @param symbols The symbols to find
+ * @param count The number of symbols
+ * @param slots The slots of the symbols, -1 for any symbol that was not found
+ */
+void findExportSlots(PeFile* file, const PeSymbol* symbols, int count, int64_t* slots) {
+    auto findName = file->exportLookup == PELOADER_EXPORT_LOOKUP_NATIVE ? findNativeName : findIndexedName;
+
+    for(int i = 0; i < count; i++) {
+        auto symbol = &symbols[i];
+        slots[i] = symbol->ordinal != -1 ? findOrdinalSlot(file, symbol->ordinal) : -1;
+        if(slots[i] < 0 && symbol->name != nullptr) {
+            slots[i] = nameSlot(file, findName(file, symbol->name));
+        }
+    }
+}
+
+/**
+ * Finds the address table slot of an export by ordinal. The ordinal minus the ordinal base is the slot, so this is a
+ * bounds check and nothing more.
+ *
+ * @param file The file to search
+ * @param ordinal The ordinal of the export
+ * @return The slot in the export address table, or -1 if not found
+ */
+int64_t findOrdinalSlot(PeFile* file, int ordinal) {
+    auto table = &file->exportTable;
+    if(ordinal < 0 || (uint32_t) ordinal < table->ordinalBase) {
+        return -1;
+    }
+
+    auto slot = (uint32_t) ordinal - table->ordinalBase;
+    if(slot >= table->addressCount || table->addresses[slot] == 0) {
+        return -1;
+    }
+    return slot;
+}
+
+/**
+ * Gets the address of an export from its address table slot.
+ *
+ * @param file The file that exports the address
+ * @param slot The slot in the export address table
+ * @return The address of the export, or nullptr if the slot is empty
+ */
+void* exportAddress(PeFile* file, uint32_t slot) {
+    return resolveRva<void>(file, file->exportTable.addresses[slot]);
+}
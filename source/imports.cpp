@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+#include "imports.h"
+#include "rva.h"
+
+#define PAGE_SIZE (0x1000)
+
+/**
+ * Serializes the stores that have to make a page of an import address table writable, so one store can't protect the
+ * page again while another one is still writing to it.
+ */
+static std::mutex importPageLock;
+
+/**
+ * A basic error handler for an unbound import, we don't mandate that all imports are bound before usage of a symbol.
+ */
+PE_FUNC void unboundImport() {
+    fprintf(stderr, "An unbound import was called!\n");
+    abort();
+}
+
+/**
+ * Gets the number of entries of the ordinal index of an import module. Direct indexing is only used when at most half
+ * of the table would be holes.
+ *
+ * @param count The number of functions that are imported by ordinal
+ * @param low The lowest imported ordinal
+ * @param high The highest imported ordinal
+ * @return The number of entries, 0 if nothing is imported by ordinal
+ */
+int importOrdinalIndexSize(int count, int low, int high) {
+    if(count == 0) {
+        return 0;
+    }
+
+    int span = high - low + 1;
+    return span <= count * 2 ? span : count;
+}
+
+/**
+ * Builds the ordinal index for an import module. When the imported ordinals are dense they are indexed directly,
+ * otherwise they are sorted so the index never grows with the gaps between ordinals.
+ *
+ * @param module The module to index
+ * @param ordinals The entries of the index, as many as importOrdinalIndexSize gives for the module
+ */
+void buildImportOrdinalIndex(PeImportModule* module, PeImportOrdinal* ordinals) {
+    int count = 0;
+    int low = INT_MAX;
+    int high = INT_MIN;
+    for(int i = 0; i < module->functionCount; i++) {
+        auto ordinal = module->functions[i].ordinal;
+        if(ordinal == -1) {
+            continue;
+        }
+
+        count++;
+        low = std::min(low, ordinal);
+        high = std::max(high, ordinal);
+    }
+
+    module->ordinals = nullptr;
+    module->ordinalCount = 0;
+    module->ordinalLow = low;
+    module->ordinalsDirect = false;
+    if(count == 0) {
+        return;
+    }
+
+    // Direct indexing is only used when at most half of the table would be holes, like importOrdinalIndexSize
+    int span = high - low + 1;
+    if(span <= count * 2) {
+        for(int i = 0; i < span; i++) {
+            ordinals[i].ordinal = low + i;
+            ordinals[i].index = -1;
+        }
+        for(int i = module->functionCount - 1; i >= 0; i--) {
+            auto ordinal = module->functions[i].ordinal;
+            if(ordinal != -1) {
+                ordinals[ordinal - low].index = i;
+            }
+        }
+
+        module->ordinals = ordinals;
+        module->ordinalCount = span;
+        module->ordinalsDirect = true;
+        return;
+    }
+
+    int current = 0;
+    for(int i = 0; i < module->functionCount; i++) {
+        auto ordinal = module->functions[i].ordinal;
+        if(ordinal != -1) {
+            ordinals[current].ordinal = ordinal;
+            ordinals[current].index = i;
+            current++;
+        }
+    }
+    std::stable_sort(ordinals, ordinals + count, [](const PeImportOrdinal& a, const PeImportOrdinal& b) -> bool {
+        return a.ordinal < b.ordinal;
+    });
+
+    module->ordinals = ordinals;
+    module->ordinalCount = count;
+}
+
+/**
+ * Finds the function of an import module that imports an ordinal.
+ *
+ * @param module The module to search
+ * @param ordinal The ordinal to find
+ * @return The imported function, or nullptr if the module does not import the ordinal
+ */
+PeImportedFunction* findImportOrdinal(PeImportModule* module, int ordinal) {
+    if(module->ordinals == nullptr || ordinal < module->ordinalLow) {
+        return nullptr;
+    }
+
+    int index = -1;
+    if(module->ordinalsDirect) {
+        auto offset = ordinal - module->ordinalLow;
+        if(offset < module->ordinalCount) {
+            index = module->ordinals[offset].index;
+        }
+    } else {
+        auto end = module->ordinals + module->ordinalCount;
+        auto found = std::lower_bound(module->ordinals, end, ordinal, [](const PeImportOrdinal& a, int b) -> bool {
+            return a.ordinal < b;
+        });
+        if(found != end && found->ordinal == ordinal) {
+            index = found->index;
+        }
+    }
+
+    return index == -1 ? nullptr : &module->functions[index];
+}
+
+/**
+ * Orders bindings by module and then by name.
+ */
+static bool bindingNameLess(const PeImportBinding* a, const PeImportBinding* b) {
+    auto comparison = strcmp(a->module, b->module);
+    return comparison != 0 ? comparison < 0 : strcmp(a->symbol.name, b->symbol.name) < 0;
+}
+
+/**
+ * Orders bindings by module and then by ordinal.
+ */
+static bool bindingOrdinalLess(const PeImportBinding* a, const PeImportBinding* b) {
+    auto comparison = strcmp(a->module, b->module);
+    return comparison != 0 ? comparison < 0 : a->symbol.ordinal < b->symbol.ordinal;
+}
+
+/**
+ * Finds the binding for an imported function in a sorted binding table.
+ *
+ * @param table The sorted bindings
+ * @param count The number of bindings
+ * @param key The binding to look for
+ * @param less The order the table is sorted in
+ * @return The matching binding, or nullptr if there is none
+ */
+static const PeImportBinding* findBinding(
+    const PeImportBinding** table,
+    int count,
+    const PeImportBinding* key,
+    bool (*less)(const PeImportBinding*, const PeImportBinding*)
+) {
+    auto end = table + count;
+    auto found = std::lower_bound(table, end, key, less);
+    if(found == end || less(key, *found)) {
+        return nullptr;
+    }
+    return *found;
+}
+
+/**
+ * Binds the imports of a PE file that are provided by the options, in a single pass over the imported functions. The
+ * binding table is sorted once so every function is a binary search, then the resolver is invoked once per module.
+ *
+ * @param file The file to bind the imports of
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
+ */
+int bindImports(PeFile* file, const PeLoaderOpen* options) {
+    auto bindings = options->imports.bindings;
+    auto bindingCount = bindings == nullptr ? 0 : options->imports.bindingCount;
+    auto resolver = options->imports.resolver;
+    if((bindingCount <= 0 && resolver == nullptr) || file->importCount == 0) {
+        return 0;
+    }
+
+    // Bindings can be looked up by name, by ordinal or both
+    auto byName = new const PeImportBinding*[bindingCount > 0 ? bindingCount : 1];
+    auto byOrdinal = new const PeImportBinding*[bindingCount > 0 ? bindingCount : 1];
+    int nameCount = 0;
+    int ordinalCount = 0;
+    for(int i = 0; i < bindingCount; i++) {
+        auto binding = &bindings[i];
+        if(binding->module == nullptr) {
+            continue;
+        }
+        if(binding->symbol.name != nullptr) {
+            byName[nameCount++] = binding;
+        }
+        if(binding->symbol.ordinal != -1) {
+            byOrdinal[ordinalCount++] = binding;
+        }
+    }
+    std::sort(byName, byName + nameCount, bindingNameLess);
+    std::sort(byOrdinal, byOrdinal + ordinalCount, bindingOrdinalLess);
+
+    int result = 0;
+    PeSymbol* symbols = nullptr;
+    int symbolCapacity = 0;
+
+    for(int i = 0; i < file->importCount && result == 0; i++) {
+        auto module = &file->imports[i];
+        if(module->name == nullptr || module->functionCount == 0) {
+            continue;
+        }
+
+        if(symbolCapacity < module->functionCount) {
+            delete[] symbols;
+            symbolCapacity = module->functionCount;
+            symbols = new PeSymbol[symbolCapacity];
+        }
+
+        for(int o = 0; o < module->functionCount; o++) {
+            auto function = &module->functions[o];
+
+            PeImportBinding key;
+            key.module = module->name;
+            key.symbol.name = function->name;
+            key.symbol.ordinal = function->ordinal;
+
+            const PeImportBinding* binding = nullptr;
+            if(function->ordinal != -1) {
+                binding = findBinding(byOrdinal, ordinalCount, &key, bindingOrdinalLess);
+            }
+            if(binding == nullptr && function->name != nullptr) {
+                binding = findBinding(byName, nameCount, &key, bindingNameLess);
+            }
+
+            auto symbol = &symbols[o];
+            symbol->name = function->name;
+            symbol->ordinal = function->ordinal;
+            symbol->address = binding == nullptr ? nullptr : binding->symbol.address;
+        }
+
+        if(resolver != nullptr) {
+            result = resolver(module->name, symbols, module->functionCount, options->imports.user);
+            if(result > 0) {
+                result = 0;
+            }
+        }
+
+        for(int o = 0; o < module->functionCount && result == 0; o++) {
+            if(symbols[o].address != nullptr) {
+                *module->functions[o].address = symbols[o].address;
+            }
+        }
+    }
+
+    delete[] symbols;
+    delete[] byOrdinal;
+    delete[] byName;
+
+    return result;
+}
+
+/**
+ * Gets the protection that applySegmentPerms gave a page of an import address table.
+ *
+ * @param file The file the page is in
+ * @param page The start of the page
+ * @return The PROT_ flags of the page
+ */
+static int importPagePerms(PeFile* file, uintptr_t page) {
+    int perms = 0;
+    bool covered = false;
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        auto start = reinterpret_cast<uintptr_t>(section->pointer);
+        if(section->pointer == nullptr || section->size == 0 || start >= page + PAGE_SIZE || start + section->size <= page) {
+            continue;
+        }
+        perms |= sectionPerms(section);
+        covered = true;
+    }
+    return pagePerms(perms, covered, true, file->lazyImports != nullptr);
+}
+
+/**
+ * Runs a store to a slot of an import address table. When the page of the slot is read-only it is made writable only
+ * for the store. Pages that hold code are always writable, see pagePerms, so no code ever loses PROT_EXEC here.
+ *
+ * @tparam Store The type of the store
+ * @param file The file the slot is in
+ * @param slot The slot to store to
+ * @param store The store to run
+ * @return 0 on success, <0 on error
+ */
+template <typename Store> static int storeImportSlot(PeFile* file, void** slot, Store store) {
+    auto page = reinterpret_cast<uintptr_t>(slot) & ~(uintptr_t) (PAGE_SIZE - 1);
+    auto perms = importPagePerms(file, page);
+    if((perms & PROT_WRITE) != 0) {
+        store();
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> guard(importPageLock);
+    auto pointer = reinterpret_cast<void*>(page);
+    if(mprotect(pointer, PAGE_SIZE, perms | PROT_READ | PROT_WRITE) != 0) {
+        return -errno;
+    }
+    store();
+    if(mprotect(pointer, PAGE_SIZE, perms) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * Binds a slot of an import address table. Other threads may be calling through the slot, they see either the old or
+ * the new address.
+ *
+ * @param file The file the slot is in
+ * @param slot The slot to bind
+ * @param address The address to bind the slot to
+ * @return 0 on success, <0 on error
+ */
+int storeImport(PeFile* file, void** slot, void* address) {
+    return storeImportSlot(file, slot, [&]() {
+        __atomic_store_n(slot, address, __ATOMIC_RELEASE);
+    });
+}
+
+/**
+ * Binds a slot of an import address table if it still holds the expected address.
+ *
+ * @param file The file the slot is in
+ * @param slot The slot to bind
+ * @param expected The address the slot has to hold, updated to what the slot holds when it is not bound
+ * @param address The address to bind the slot to
+ * @return 0 when the slot is bound, -EAGAIN when it held something else, <0 on other errors
+ */
+int exchangeImport(PeFile* file, void** slot, void** expected, void* address) {
+    bool exchanged = false;
+    auto result = storeImportSlot(file, slot, [&]() {
+        exchanged = __atomic_compare_exchange_n(slot, expected, address, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+    });
+    if(result == 0 && !exchanged) {
+        result = -EAGAIN;
+    }
+    return result;
+}
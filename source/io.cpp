@@ -1,16 +1,28 @@
+#include <algorithm>
 #include <cerrno>
+#include <climits>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 
 extern "C" {
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 }
 
 #include "io.h"
 
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 
+#define PAGE_SIZE (0x1000)
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+// The largest hole between two reads that readBatch will read through instead of splitting the batch
+#define MAX_BATCH_GAP (0x10000)
+
 /**
  * Opens a file from disk.
  *
@@ -20,6 +32,7 @@ extern "C" {
  */
 int openFile(File* file, const char* path) {
     file->fileType = TYPE_FILE;
+    file->ioCalls = 0;
     file->fileHandle = open(path, O_NOFOLLOW);
     if(file->fileHandle == -1) {
         return -errno;
@@ -27,6 +40,48 @@ int openFile(File* file, const char* path) {
     return 0;
 }
 
+/**
+ * Maps a file that was opened with openFile into memory. Reads are served from the mapping and sections can be mapped
+ * directly from the file with mapFully. If the file can not be mapped it stays a plain TYPE_FILE.
+ *
+ * @param file The file handle
+ * @param length The length of the file
+ */
+void mapFile(File* file, size_t length) {
+    if(length == 0) {
+        return;
+    }
+
+    auto pointer = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file->fileHandle, 0);
+    file->ioCalls++;
+    if(pointer == MAP_FAILED) {
+        return;
+    }
+
+    auto fileHandle = file->fileHandle;
+    file->fileType = TYPE_MAPPED;
+    file->mappedFile.pointer = pointer;
+    file->mappedFile.length = length;
+    file->mappedFile.offset = 0;
+    file->mappedFile.fileHandle = fileHandle;
+}
+
+/**
+ * Drops the mapping of a mapped file, it is read through its handle from then on. Anything else is left alone.
+ *
+ * @param file The file handle
+ */
+void unmapFile(File* file) {
+    if(file->fileType != TYPE_MAPPED) {
+        return;
+    }
+
+    auto fileHandle = file->mappedFile.fileHandle;
+    munmap(const_cast<void*>(file->mappedFile.pointer), file->mappedFile.length);
+    file->fileType = TYPE_FILE;
+    file->fileHandle = fileHandle;
+}
+
 /**
  * "Opens" a file from memory.
  *
@@ -43,6 +98,7 @@ int openMemory(File* file, const void* pointer, size_t length, PeFileFreeCallbac
     }
 
     file->fileType = TYPE_BUFFER;
+    file->ioCalls = 0;
     file->memFile.pointer = pointer;
     file->memFile.length = length;
     file->memFile.offset = 0;
@@ -76,6 +132,16 @@ int closeFile(File* file) {
             return 0;
         } break;
 
+        case TYPE_MAPPED: {
+            int result = 0;
+            munmap(const_cast<void*>(file->mappedFile.pointer), file->mappedFile.length);
+            if(close(file->mappedFile.fileHandle) != 0) {
+                result = -errno;
+            }
+            file->fileType = TYPE_CLOSED;
+            return result;
+        } break;
+
         case TYPE_CLOSED: {
             return 0;
         } break;
@@ -87,6 +153,61 @@ int closeFile(File* file) {
     }
 }
 
+/**
+ * Gets the size of a file.
+ *
+ * @param file The file to get the size of
+ * @param size Set to the size of the file
+ * @return 0 on success, <0 on error
+ */
+int fileSize(File* file, size_t* size) {
+    switch(file->fileType) {
+        case TYPE_FILE: {
+            struct stat64 stat;
+            if(fstat64(file->fileHandle, &stat) != 0) {
+                return -errno;
+            }
+            *size = (size_t) stat.st_size;
+            return 0;
+        }
+
+        case TYPE_BUFFER:
+        case TYPE_MAPPED: {
+            fileView(file, size);
+            return 0;
+        }
+
+        default: {
+            return -EBADF;
+        }
+    }
+}
+
+/**
+ * Gets the whole contents of a file that lives in memory without copying it.
+ *
+ * @param file The file to view
+ * @param length The length of the file
+ * @return A pointer to the start of the file, or nullptr if the file is not in memory
+ */
+const void* fileView(File* file, size_t* length) {
+    switch(file->fileType) {
+        case TYPE_BUFFER: {
+            *length = file->memFile.length;
+            return file->memFile.pointer;
+        }
+
+        case TYPE_MAPPED: {
+            *length = file->mappedFile.length;
+            return file->mappedFile.pointer;
+        }
+
+        default: {
+            return nullptr;
+        }
+    }
+}
+
 /**
  * Seeks to a specific point in an open file.
  *
@@ -97,6 +218,7 @@ int closeFile(File* file) {
 off64_t fileSeek(File* file, size_t offset) {
     switch(file->fileType) {
         case TYPE_FILE: {
+            file->ioCalls++;
             auto result = lseek64(file->fileHandle, offset, SEEK_SET);
             if(result == (off_t) -1) return -errno;
             return result;
@@ -111,6 +233,15 @@ off64_t fileSeek(File* file, size_t offset) {
             return (off64_t) offset;
         } break;
 
+        case TYPE_MAPPED: {
+            if(offset > file->mappedFile.length) {
+                errno = EIO;
+                return -1;
+            }
+            file->mappedFile.offset = offset;
+            return (off64_t) offset;
+        } break;
+
         case TYPE_CLOSED: {
             errno = EIO;
             return -1;
@@ -140,12 +271,16 @@ ssize_t readPartially(File* file, void* buffer, size_t length) {
         ssize_t transferred;
         switch(file->fileType) {
             case TYPE_FILE: {
+                file->ioCalls++;
                 transferred = read(file->fileHandle, reinterpret_cast<void*>(pointer), end - pointer);
             } break;
 
-            case TYPE_BUFFER: {
+            case TYPE_BUFFER:
+            case TYPE_MAPPED: {
                 transferred = MIN(end - pointer, bufferRemaining(file));
+                if(transferred == 0) break;
                 memcpy(reinterpret_cast<void*>(pointer), bufferPointer(file), transferred);
+                bufferAdvance(file, transferred);
             } break;
 
             case TYPE_CLOSED: {
@@ -168,6 +303,41 @@ ssize_t readPartially(File* file, void* buffer, size_t length) {
     return pointer - start;
 }
 
+/**
+ * Reads from a file starting at offset until the file ends or length bytes are read. Plain files are read with pread so
+ * this only costs one call for most reads.
+ *
+ * @param file The file to read from
+ * @param offset The offset into the file to read from
+ * @param buffer The buffer to read into
+ * @param length The max amount of bytes to read
+ * @return The amount of bytes read on success or a negative number on error
+ */
+ssize_t readPartially(File* file, size_t offset, void* buffer, size_t length) {
+    if(file->fileType != TYPE_FILE) {
+        if(fileSeek(file, offset) != (off64_t) offset) {
+            return -errno;
+        }
+        return readPartially(file, buffer, length);
+    }
+
+    auto pointer = static_cast<char*>(buffer);
+    size_t total = 0;
+    while(total < length) {
+        file->ioCalls++;
+        auto transferred = pread64(file->fileHandle, pointer + total, length - total, (off64_t) (offset + total));
+        if(transferred == 0) {
+            break;
+        } else if(transferred < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        }
+        total += transferred;
+    }
+
+    return (ssize_t) total;
+}
+
 /**
  * Reads length bytes from a file and returns an error code if the file is too small.
  *
@@ -204,3 +374,179 @@ int readFully(File* file, size_t offset, void* buffer, size_t length) {
 
     return readFully(file, buffer, length);
 }
+
+/**
+ * Places length bytes from a file starting at offset into buffer. When the file is mapped and the file offset shares
+ * the page alignment of the buffer the whole pages are mapped directly from the file with MAP_PRIVATE so they are
+ * shared with the page cache, only the partial pages at either end are copied. Any other file falls back to
+ * readFully(handle, offset, buffer, length).
+ *
+ * @param file The file to read from
+ * @param offset The offset into the file to read from
+ * @param buffer The buffer to place the data in, the pages it covers must be owned by the caller
+ * @param length The number of bytes to place
+ * @return 0 on success or <0 on error
+ */
+int mapFully(File* file, size_t offset, void* buffer, size_t length) {
+    auto start = reinterpret_cast<uintptr_t>(buffer);
+    if(
+        file->fileType != TYPE_MAPPED ||
+        ((start ^ offset) & PAGE_MASK) != 0 ||
+        offset + length > file->mappedFile.length
+    ) {
+        return readFully(file, offset, buffer, length);
+    }
+
+    auto mapStart = (start + PAGE_MASK) & ~(uintptr_t) PAGE_MASK;
+    auto mapEnd = (start + length) & ~(uintptr_t) PAGE_MASK;
+    if(mapStart >= mapEnd) {
+        return readFully(file, offset, buffer, length);
+    }
+
+    auto leading = mapStart - start;
+    if(leading != 0) {
+        auto result = readFully(file, offset, buffer, leading);
+        if(result < 0) return result;
+    }
+
+    auto mapped = mmap(
+        reinterpret_cast<void*>(mapStart),
+        mapEnd - mapStart,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED,
+        file->mappedFile.fileHandle,
+        (off_t) (offset + leading)
+    );
+    file->ioCalls++;
+    if(mapped == MAP_FAILED) {
+        return -errno;
+    }
+
+    auto trailing = start + length - mapEnd;
+    if(trailing != 0) {
+        return readFully(file, offset + (mapEnd - start), reinterpret_cast<void*>(mapEnd), trailing);
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a run of iovecs that cover a contiguous region of a file with as few preadv calls as possible.
+ *
+ * @param file The file to read from, must be TYPE_FILE
+ * @param offset The offset of the region in the file
+ * @param vectors The buffers to read the region into, modified as data is transferred
+ * @param count The number of buffers
+ * @return 0 on success or <0 on error
+ */
+static int readVectorsFully(File* file, size_t offset, struct iovec* vectors, int count) {
+    while(count > 0) {
+        file->ioCalls++;
+        auto transferred = preadv64(file->fileHandle, vectors, count, (off64_t) offset);
+        if(transferred < 0) {
+            if(errno == EINTR) continue;
+            return -errno;
+        } else if(transferred == 0) {
+            return -EIO;
+        }
+        offset += transferred;
+
+        // Skip over everything that was completely filled and trim the first partial buffer
+        while(count > 0 && (size_t) transferred >= vectors->iov_len) {
+            transferred -= (ssize_t) vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if(count > 0) {
+            vectors->iov_base = reinterpret_cast<void*>(reinterpret_cast<intptr_t>(vectors->iov_base) + transferred);
+            vectors->iov_len -= transferred;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Performs a set of reads against a file. The reads are sorted by their offset and reads that are adjacent, or only
+ * separated by a small hole, are merged into a single preadv call. Files that are not TYPE_FILE, or that do not support
+ * positional reads, fall back to one readFully per read.
+ *
+ * @param file The file to read from
+ * @param reads The reads to perform, reordered by offset on return
+ * @param count The number of reads
+ * @return 0 on success or <0 on error
+ */
+int readBatch(File* file, FileRead* reads, int count) {
+    if(count <= 0) {
+        return 0;
+    }
+
+    std::sort(reads, reads + count, [](const FileRead& a, const FileRead& b) -> bool {
+        return a.offset < b.offset;
+    });
+
+    if(file->fileType == TYPE_FILE) {
+        // Holes between reads are read into a scratch buffer that is never looked at. Every thread keeps its own, so
+        // concurrent opens do not write the same memory and a thread only allocates it once.
+        static thread_local std::unique_ptr<char[]> gapBuffer;
+
+        auto vectors = new struct iovec[MIN(count * 2, IOV_MAX)];
+        int result = 0;
+
+        for(int i = 0; i < count && result == 0;) {
+            // Empty reads have nothing to merge, every group starts at a read with data
+            while(i < count && reads[i].length == 0) {
+                i++;
+            }
+            if(i == count) {
+                break;
+            }
+
+            size_t start = reads[i].offset;
+            size_t end = start;
+            int vectorCount = 0;
+
+            for(; i < count && vectorCount + 2 <= IOV_MAX; i++) {
+                auto read = &reads[i];
+                if(read->length == 0) {
+                    continue;
+                }
+                if(read->offset < end || read->offset - end > MAX_BATCH_GAP) {
+                    break;
+                }
+
+                if(read->offset != end) {
+                    if(gapBuffer == nullptr) {
+                        gapBuffer.reset(new char[MAX_BATCH_GAP]);
+                    }
+                    vectors[vectorCount].iov_base = gapBuffer.get();
+                    vectors[vectorCount].iov_len = read->offset - end;
+                    vectorCount++;
+                }
+                vectors[vectorCount].iov_base = read->buffer;
+                vectors[vectorCount].iov_len = read->length;
+                vectorCount++;
+                end = read->offset + read->length;
+            }
+
+            result = readVectorsFully(file, start, vectors, vectorCount);
+            if(result == -ESPIPE || result == -ENOSYS) {
+                // Not a file that supports positional reads, use the slow path
+                result = 1;
+            }
+        }
+
+        delete[] vectors;
+
+        if(result <= 0) {
+            return result;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        auto result = readFully(file, reads[i].offset, reads[i].buffer, reads[i].length);
+        if(result < 0) return result;
+    }
+
+    return 0;
+}
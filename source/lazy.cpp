@@ -0,0 +1,193 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "imports.h"
+#include "lazy.h"
+
+/**
+ * The size of a single trampoline, each one loads its import into r11 and jumps to the shared thunk.
+ */
+#define TRAMPOLINE_SIZE 32
+
+extern "C" {
+/**
+ * The shared part of every trampoline. The arguments of the original call are saved, the import in r11 is resolved and
+ * the arguments are restored before jumping to the resolved address, so the original call continues as if the import
+ * was always bound.
+ */
+PE_FUNC void lazyImportThunk();
+
+/**
+ * Resolves a lazy import and updates the import address table, called from lazyImportThunk.
+ *
+ * @param import The import to resolve
+ * @return The resolved address
+ */
+__attribute__((visibility("hidden"), used)) PE_FUNC void* lazyResolveImport(PeLazyImport* import);
+}
+
+// Entered with the return address on top of the stack and the caller's 32 byte home space above it. The integer
+// arguments are stored in the home space, the vector arguments below the home space of the resolver call, which keeps
+// the stack 16 byte aligned.
+asm(R"(
+    .text
+    .p2align 4
+    .type lazyImportThunk, @function
+lazyImportThunk:
+    movq %rcx, 0x08(%rsp)
+    movq %rdx, 0x10(%rsp)
+    movq %r8, 0x18(%rsp)
+    movq %r9, 0x20(%rsp)
+    subq $0x68, %rsp
+    movaps %xmm0, 0x20(%rsp)
+    movaps %xmm1, 0x30(%rsp)
+    movaps %xmm2, 0x40(%rsp)
+    movaps %xmm3, 0x50(%rsp)
+    movq %r11, %rcx
+    call lazyResolveImport
+    movaps 0x20(%rsp), %xmm0
+    movaps 0x30(%rsp), %xmm1
+    movaps 0x40(%rsp), %xmm2
+    movaps 0x50(%rsp), %xmm3
+    addq $0x68, %rsp
+    movq 0x08(%rsp), %rcx
+    movq 0x10(%rsp), %rdx
+    movq 0x18(%rsp), %r8
+    movq 0x20(%rsp), %r9
+    jmp *%rax
+    .size lazyImportThunk, .-lazyImportThunk
+)");
+
+PE_FUNC void* lazyResolveImport(PeLazyImport* import) {
+    auto function = import->function;
+    PeSymbol symbol = {
+        .name = function->name,
+        .address = nullptr,
+        .ordinal = function->ordinal
+    };
+
+    auto address = import->resolver(import->module->name, &symbol, import->user);
+    if(address == nullptr) {
+        if(function->name != nullptr) {
+            fprintf(stderr, "Unable to resolve import %s!%s\n", import->module->name, function->name);
+        } else {
+            fprintf(stderr, "Unable to resolve import %s!#%d\n", import->module->name, function->ordinal);
+        }
+        abort();
+    }
+
+    // A binding made with peloader_import while this was resolving wins, and so does a racing first call that got here
+    // first
+    auto expected = import->trampoline;
+    auto result = exchangeImport(import->file, function->address, &expected, address);
+    if(result == -EAGAIN) {
+        return expected;
+    } else if(result != 0) {
+        fprintf(stderr, "Unable to bind import %s: %s\n", import->module->name, strerror(-result));
+        abort();
+    }
+    return address;
+}
+
+/**
+ * Writes a trampoline that calls lazyImportThunk with the import in r11.
+ *
+ * @param code The memory to write the trampoline to
+ * @param import The import the trampoline resolves
+ */
+static void writeTrampoline(uint8_t* code, PeLazyImport* import) {
+    auto data = reinterpret_cast<uint64_t>(import);
+    auto thunk = reinterpret_cast<uint64_t>(lazyImportThunk);
+
+    memset(code, 0xCC, TRAMPOLINE_SIZE);
+
+    // mov r11, data
+    code[0] = 0x49;
+    code[1] = 0xBB;
+    memcpy(code + 2, &data, sizeof(data));
+
+    // mov rax, thunk
+    code[10] = 0x48;
+    code[11] = 0xB8;
+    memcpy(code + 12, &thunk, sizeof(thunk));
+
+    // jmp rax
+    code[20] = 0xFF;
+    code[21] = 0xE0;
+}
+
+/**
+ * Points every import that is still unbound at a trampoline that resolves it on the first call.
+ *
+ * @param file The file to create the trampolines for
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
+ */
+int createLazyImports(PeFile* file, const PeLoaderOpen* options) {
+    auto resolver = options->lazyImports.resolver;
+    if(resolver == nullptr) {
+        return 0;
+    }
+
+    int count = 0;
+    for(int i = 0; i < file->importCount; i++) {
+        auto module = &file->imports[i];
+        for(int o = 0; o < module->functionCount; o++) {
+            count += *module->functions[o].address == reinterpret_cast<void*>(unboundImport);
+        }
+    }
+    if(count == 0) {
+        return 0;
+    }
+
+    size_t size = ((size_t) count * TRAMPOLINE_SIZE + 0xFFF) & ~(size_t) 0xFFF;
+    auto code = reinterpret_cast<uint8_t*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if(code == MAP_FAILED) {
+        return -errno;
+    }
+    file->lazyTrampolines = code;
+    file->lazyTrampolinesSize = size;
+
+    auto imports = new PeLazyImport[count];
+    file->lazyImports = imports;
+
+    for(int i = 0; i < file->importCount; i++) {
+        auto module = &file->imports[i];
+        for(int o = 0; o < module->functionCount; o++) {
+            auto function = &module->functions[o];
+            if(*function->address != reinterpret_cast<void*>(unboundImport)) {
+                continue;
+            }
+
+            imports->file = file;
+            imports->module = module;
+            imports->function = function;
+            imports->resolver = resolver;
+            imports->user = options->lazyImports.user;
+            imports->trampoline = code;
+
+            writeTrampoline(code, imports);
+            *function->address = code;
+
+            imports++;
+            code += TRAMPOLINE_SIZE;
+        }
+    }
+
+    if(mprotect(file->lazyTrampolines, size, PROT_READ | PROT_EXEC) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+void freeLazyImports(PeFile* file) {
+    if(file->lazyTrampolines != nullptr) {
+        munmap(file->lazyTrampolines, file->lazyTrampolinesSize);
+    }
+    delete[] file->lazyImports;
+}
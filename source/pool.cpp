@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pool.h"
+
+/**
+ * The most threads that the shared pool will grow to.
+ */
+#define MAX_POOL_THREADS (64)
+
+/**
+ * A process wide pool of worker threads. It starts empty and grows to the largest number of threads that has been asked
+ * for, the threads wait for tasks until the process exits.
+ */
+class WorkerPool {
+public:
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for(auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Queues a task, growing the pool first if it has less than the wanted number of threads.
+     *
+     * @param wanted The number of threads the caller wants to be available
+     * @param task The task to run
+     */
+    void submit(int wanted, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while((int) workers.size() < wanted && workers.size() < MAX_POOL_THREADS) {
+                workers.emplace_back([this]() { run(); });
+            }
+            tasks.push_back(std::move(task));
+        }
+        condition.notify_one();
+    }
+
+private:
+    void run() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if(tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+};
+
+static WorkerPool pool;
+
+/**
+ * The state shared by the threads of one parallelFor. It is reference counted because helpers may only get to run after
+ * every index is done.
+ */
+typedef struct {
+    std::atomic<int> next;
+    std::atomic<int> error;
+    int count;
+    int done;
+    std::mutex mutex;
+    std::condition_variable finished;
+} ParallelState;
+
+/**
+ * Runs indices until there are none left.
+ *
+ * @param state The shared state
+ * @param body The body to run, only touched while an index is claimed
+ */
+static void runIndices(ParallelState* state, const std::function<int(int)>& body) {
+    int completed = 0;
+    for(int index; (index = state->next.fetch_add(1, std::memory_order_relaxed)) < state->count;) {
+        auto result = body(index);
+        if(result < 0) {
+            int expected = 0;
+            state->error.compare_exchange_strong(expected, result, std::memory_order_relaxed);
+        }
+        completed++;
+    }
+
+    if(completed != 0) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done += completed;
+        if(state->done == state->count) {
+            state->finished.notify_all();
+        }
+    }
+}
+
+/**
+ * Runs a body for every index from 0 to count on up to the given number of threads, the calling thread included. The
+ * calling thread never waits on a helper that has not started, so this is safe to use from inside of the pool.
+ *
+ * @param threads The most threads to use
+ * @param count The number of indices
+ * @param body The body to run for each index, returns <0 on error
+ * @return 0 on success, the first error a body returned otherwise
+ */
+int parallelFor(int threads, int count, const std::function<int(int)>& body) {
+    auto state = std::make_shared<ParallelState>();
+    state->next = 0;
+    state->error = 0;
+    state->count = count;
+    state->done = 0;
+
+    auto helpers = std::min(threads, count) - 1;
+    for(int i = 0; i < helpers; i++) {
+        pool.submit(helpers, [state, &body]() { runIndices(state.get(), body); });
+    }
+    runIndices(state.get(), body);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&]() { return state->done == state->count; });
+
+    return state->error.load(std::memory_order_relaxed);
+}
+
+/**
+ * Runs a task on the pool without waiting for it.
+ *
+ * @param threads The number of threads the pool should have to run this and other detached tasks
+ * @param task The task to run
+ */
+void runDetached(int threads, std::function<void()> task) {
+    pool.submit(threads, std::move(task));
+}
@@ -0,0 +1,140 @@
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "registry.h"
+
+/**
+ * The number of buckets of the registry.
+ */
+#define REGISTRY_BUCKETS (256)
+
+/**
+ * The bits of an entry state, the low bits count the references and the high half is bumped every time the entry is
+ * reused for another file.
+ */
+#define STATE_REFS      (0x7FFFFFFFULL)
+#define STATE_BUSY      (0x80000000ULL)
+#define STATE_NEXT_GEN  (0x100000000ULL)
+
+/**
+ * An entry of the registry. Entries are never freed, an entry without references is reused for the next file that is
+ * registered in the same bucket. That lets lookups walk the buckets without taking a lock, an entry that is reused while
+ * it is being looked at is caught by the generation in its state.
+ */
+struct PeRegistryEntry {
+    std::atomic<uint64_t> state;
+
+    std::atomic<uint64_t> device;
+    std::atomic<uint64_t> inode;
+    std::atomic<uint64_t> size;
+    std::atomic<int64_t> time;
+
+    std::atomic<PeFile*> file;
+    std::atomic<PeRegistryEntry*> next;
+};
+
+static std::atomic<PeRegistryEntry*> buckets[REGISTRY_BUCKETS];
+
+/**
+ * Serializes registering files, lookups and releases never take it.
+ */
+static std::mutex registryMutex;
+
+static inline int64_t modificationTime(const struct stat64& stat) {
+    return (int64_t) stat.st_mtim.tv_sec * 1000000000 + stat.st_mtim.tv_nsec;
+}
+
+static inline std::atomic<PeRegistryEntry*>& bucketOf(const struct stat64& stat) {
+    auto hash = ((uint64_t) stat.st_dev * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t) stat.st_ino * 0xC2B2AE3D27D4EB4FULL);
+    return buckets[(hash >> 32) % REGISTRY_BUCKETS];
+}
+
+/**
+ * Looks up a registered file and takes a reference to it.
+ *
+ * @param stat The status of the file
+ * @return The file or nullptr if it is not registered
+ */
+PeFile* acquireRegisteredFile(const struct stat64& stat) {
+    auto time = modificationTime(stat);
+    for(auto entry = bucketOf(stat).load(std::memory_order_acquire); entry != nullptr; entry = entry->next.load(std::memory_order_acquire)) {
+        auto state = entry->state.load(std::memory_order_acquire);
+        while((state & STATE_REFS) != 0 && (state & STATE_BUSY) == 0) {
+            if(
+                entry->device.load(std::memory_order_relaxed) != (uint64_t) stat.st_dev ||
+                entry->inode.load(std::memory_order_relaxed) != (uint64_t) stat.st_ino ||
+                entry->size.load(std::memory_order_relaxed) != (uint64_t) stat.st_size ||
+                entry->time.load(std::memory_order_relaxed) != time
+            ) {
+                break;
+            }
+
+            // Fails if the entry was released or reused since the key was read, a reused entry has a new generation
+            if(entry->state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return entry->file.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * Adds a file to the registry with one reference. When another thread registered the same file first that file is
+ * returned instead and the caller has to close its own copy.
+ *
+ * @param file The file to register
+ * @param stat The status of the file
+ * @return The registered file with a reference taken for the caller
+ */
+PeFile* registerFile(PeFile* file, const struct stat64& stat) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    auto existing = acquireRegisteredFile(stat);
+    if(existing != nullptr) {
+        return existing;
+    }
+
+    auto& bucket = bucketOf(stat);
+    PeRegistryEntry* entry = nullptr;
+    uint64_t state = 0;
+    for(auto current = bucket.load(std::memory_order_acquire); current != nullptr; current = current->next.load(std::memory_order_acquire)) {
+        state = current->state.load(std::memory_order_acquire);
+        if(
+            (state & (STATE_REFS | STATE_BUSY)) == 0 &&
+            current->state.compare_exchange_strong(state, state | STATE_BUSY, std::memory_order_acq_rel)
+        ) {
+            entry = current;
+            break;
+        }
+    }
+    if(entry == nullptr) {
+        entry = new PeRegistryEntry();
+        state = 0;
+        entry->state.store(STATE_BUSY, std::memory_order_relaxed);
+        entry->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bucket.store(entry, std::memory_order_release);
+    }
+
+    entry->device.store((uint64_t) stat.st_dev, std::memory_order_relaxed);
+    entry->inode.store((uint64_t) stat.st_ino, std::memory_order_relaxed);
+    entry->size.store((uint64_t) stat.st_size, std::memory_order_relaxed);
+    entry->time.store(modificationTime(stat), std::memory_order_relaxed);
+    entry->file.store(file, std::memory_order_relaxed);
+    file->registryEntry = entry;
+    entry->state.store(((state & ~(STATE_REFS | STATE_BUSY)) + STATE_NEXT_GEN) | 1, std::memory_order_release);
+
+    return file;
+}
+
+/**
+ * Drops a reference to a registered file.
+ *
+ * @param file The registered file
+ * @return true when that was the last reference and the file has to be closed
+ */
+bool releaseRegisteredFile(PeFile* file) {
+    auto previous = file->registryEntry->state.fetch_sub(1, std::memory_order_acq_rel);
+    return (previous & STATE_REFS) == 1;
+}
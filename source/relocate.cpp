@@ -0,0 +1,520 @@
+#include <cerrno>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "pool.h"
+#include "relocate.h"
+
+#define IMAGE_REL_BASED_ABSOLUTE    (0)
+#define IMAGE_REL_BASED_HIGH        (1)
+#define IMAGE_REL_BASED_LOW         (2)
+#define IMAGE_REL_BASED_HIGHLOW     (3)
+#define IMAGE_REL_BASED_HIGHADJ     (4)
+#define IMAGE_REL_BASED_DIR64       (10)
+
+#define PAGE_SIZE (0x1000)
+
+/**
+ * The number of pieces the table is cut into per thread, more pieces even out blocks that take longer than others.
+ */
+#define CHUNKS_PER_THREAD (4)
+
+/**
+ * The header of a relocation block, the 16 bit entries for the page follow it.
+ */
+typedef struct {
+    uint32_t pageRva;
+    uint32_t size;
+} RelocationBlock;
+
+/**
+ * Applies the entries of one block to a page.
+ *
+ * @param target The memory to relocate
+ * @param page The RVA of the page
+ * @param entries The entries of the block
+ * @param count The number of entries
+ * @return 0 on success, <0 on error
+ */
+typedef int (*BlockFunc)(const RelocationTarget* target, uint32_t page, const uint8_t* entries, int count);
+
+/**
+ * Adds a value to a possibly unaligned integer in memory.
+ *
+ * @tparam T The type of the integer
+ * @param address The address of the integer
+ * @param value The value to add
+ */
+template <typename T> static inline void addAt(uintptr_t address, T value) {
+    T current;
+    memcpy(&current, reinterpret_cast<void*>(address), sizeof(current));
+    current += value;
+    memcpy(reinterpret_cast<void*>(address), &current, sizeof(current));
+}
+
+static inline uint16_t entryAt(const uint8_t* entries, int index) {
+    uint16_t entry;
+    memcpy(&entry, entries + index * sizeof(entry), sizeof(entry));
+    return entry;
+}
+
+/**
+ * Gets the number of bytes that a relocation entry changes.
+ *
+ * @param type The type of the entry
+ * @return The width of the entry, 0 for padding, -ENOTSUP for unknown types
+ */
+static inline int entryWidth(int type) {
+    switch(type) {
+        case IMAGE_REL_BASED_ABSOLUTE: return 0;
+        case IMAGE_REL_BASED_HIGH:
+        case IMAGE_REL_BASED_LOW:
+        case IMAGE_REL_BASED_HIGHADJ: return sizeof(uint16_t);
+        case IMAGE_REL_BASED_HIGHLOW: return sizeof(uint32_t);
+        case IMAGE_REL_BASED_DIR64: return sizeof(uint64_t);
+        default: return -ENOTSUP;
+    }
+}
+
+/**
+ * Applies the entries of a block one at a time and checks each one against the bounds of the image. Processing stops
+ * at the first entry at or after end, a HIGHADJ entry also consumes the entry after it.
+ *
+ * @param target The memory to relocate
+ * @param page The RVA of the page
+ * @param entries The entries of the block
+ * @param index The first entry to apply
+ * @param end The entry to stop at
+ * @param count The number of entries in the block
+ * @param clip Skip entries that are not inside of the target instead of failing
+ * @return The index of the next entry to apply, <0 on error
+ */
+static int relocateEntries(
+    const RelocationTarget* target,
+    uint32_t page,
+    const uint8_t* entries,
+    int index,
+    int end,
+    int count,
+    bool clip = false
+) {
+    while(index < end) {
+        auto entry = entryAt(entries, index++);
+        auto type = entry >> 12;
+        uint64_t rva = (uint64_t) page + (entry & 0x0FFF);
+
+        auto width = entryWidth(type);
+        if(width <= 0) {
+            if(width < 0) return width;
+            continue;
+        }
+        if(rva < target->low || rva + width > target->high) {
+            if(!clip) {
+                return -EINVAL;
+            }
+            index += type == IMAGE_REL_BASED_HIGHADJ;
+            continue;
+        }
+
+        auto address = target->image + rva;
+        auto delta = target->delta;
+        switch(type) {
+            case IMAGE_REL_BASED_HIGH: {
+                addAt<uint16_t>(address, (uint16_t) ((uint64_t) delta >> 16));
+            } break;
+
+            case IMAGE_REL_BASED_LOW: {
+                addAt<uint16_t>(address, (uint16_t) delta);
+            } break;
+
+            // The high half of a 32 bit value, the low half is in the next entry and carries into the high half
+            case IMAGE_REL_BASED_HIGHADJ: {
+                if(index >= count) {
+                    return -EINVAL;
+                }
+                auto low = (int16_t) entryAt(entries, index++);
+
+                uint16_t high;
+                memcpy(&high, reinterpret_cast<void*>(address), sizeof(high));
+                auto value = (int32_t) ((uint32_t) high << 16) + low + (int32_t) delta + 0x8000;
+                high = (uint16_t) ((uint32_t) value >> 16);
+                memcpy(reinterpret_cast<void*>(address), &high, sizeof(high));
+            } break;
+
+            case IMAGE_REL_BASED_HIGHLOW: {
+                addAt<uint32_t>(address, (uint32_t) delta);
+            } break;
+
+            case IMAGE_REL_BASED_DIR64: {
+                addAt<uint64_t>(address, (uint64_t) delta);
+            } break;
+        }
+    }
+
+    return index;
+}
+
+/**
+ * Applies a block one entry at a time.
+ */
+static int relocateBlockScalar(const RelocationTarget* target, uint32_t page, const uint8_t* entries, int count) {
+    auto result = relocateEntries(target, page, entries, 0, count, count);
+    return result < 0 ? result : 0;
+}
+
+#if defined(__x86_64__)
+/**
+ * Applies a block eight entries at a time. Runs of DIR64 entries are applied without decoding each entry, runs that
+ * cover eight consecutive pointers are added with vector instructions. Anything else goes through relocateEntries. The
+ * caller has to make sure the whole page is inside of the image.
+ */
+static int relocateBlockSse2(const RelocationTarget* target, uint32_t page, const uint8_t* entries, int count) {
+    auto base = target->image + page;
+    auto delta = target->delta;
+
+    const auto typeMask = _mm_set1_epi16((short) 0xF000);
+    const auto offsetMask = _mm_set1_epi16(0x0FFF);
+    const auto dir64 = _mm_set1_epi16((short) (IMAGE_REL_BASED_DIR64 << 12));
+    const auto ramp = _mm_setr_epi16(0, 8, 16, 24, 32, 40, 48, 56);
+    const auto deltas = _mm_set1_epi64x(delta);
+
+    int index = 0;
+    while(index + 8 <= count) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + index * sizeof(uint16_t)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, typeMask), dir64)) != 0xFFFF) {
+            index = relocateEntries(target, page, entries, index, index + 8, count);
+            if(index < 0) return index;
+            continue;
+        }
+
+        auto offsets = _mm_and_si128(chunk, offsetMask);
+        auto first = _mm_cvtsi128_si32(offsets) & 0xFFFF;
+        auto run = _mm_add_epi16(_mm_set1_epi16((short) first), ramp);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(offsets, run)) == 0xFFFF) {
+            auto pointers = reinterpret_cast<__m128i*>(base + first);
+            for(int i = 0; i < 4; i++) {
+                _mm_storeu_si128(&pointers[i], _mm_add_epi64(_mm_loadu_si128(&pointers[i]), deltas));
+            }
+        } else {
+            alignas(16) uint16_t scattered[8];
+            _mm_store_si128(reinterpret_cast<__m128i*>(scattered), offsets);
+            for(auto offset : scattered) {
+                addAt<uint64_t>(base + offset, (uint64_t) delta);
+            }
+        }
+        index += 8;
+    }
+
+    index = relocateEntries(target, page, entries, index, count, count);
+    return index < 0 ? index : 0;
+}
+
+/**
+ * The AVX2 version of relocateBlockSse2, sixteen entries at a time.
+ */
+__attribute__((target("avx2")))
+static int relocateBlockAvx2(const RelocationTarget* target, uint32_t page, const uint8_t* entries, int count) {
+    auto base = target->image + page;
+    auto delta = target->delta;
+
+    const auto typeMask = _mm256_set1_epi16((short) 0xF000);
+    const auto offsetMask = _mm256_set1_epi16(0x0FFF);
+    const auto dir64 = _mm256_set1_epi16((short) (IMAGE_REL_BASED_DIR64 << 12));
+    const auto ramp = _mm256_setr_epi16(0, 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120);
+    const auto deltas = _mm256_set1_epi64x(delta);
+
+    int index = 0;
+    while(index + 16 <= count) {
+        auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entries + index * sizeof(uint16_t)));
+        if((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(chunk, typeMask), dir64)) != 0xFFFFFFFF) {
+            index = relocateEntries(target, page, entries, index, index + 16, count);
+            if(index < 0) return index;
+            continue;
+        }
+
+        auto offsets = _mm256_and_si256(chunk, offsetMask);
+        auto first = _mm256_cvtsi256_si32(offsets) & 0xFFFF;
+        auto run = _mm256_add_epi16(_mm256_set1_epi16((short) first), ramp);
+        if((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi16(offsets, run)) == 0xFFFFFFFF) {
+            auto pointers = reinterpret_cast<__m256i*>(base + first);
+            for(int i = 0; i < 4; i++) {
+                _mm256_storeu_si256(&pointers[i], _mm256_add_epi64(_mm256_loadu_si256(&pointers[i]), deltas));
+            }
+        } else {
+            alignas(32) uint16_t scattered[16];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(scattered), offsets);
+            for(auto offset : scattered) {
+                addAt<uint64_t>(base + offset, (uint64_t) delta);
+            }
+        }
+        index += 16;
+    }
+
+    index = relocateEntries(target, page, entries, index, count, count);
+    return index < 0 ? index : 0;
+}
+#endif
+
+/**
+ * Picks the fastest block function that the CPU supports.
+ *
+ * @return The block function
+ */
+static BlockFunc selectBlockFunc() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return relocateBlockAvx2;
+    }
+    return relocateBlockSse2;
+#else
+    return relocateBlockScalar;
+#endif
+}
+
+/**
+ * Applies a base relocation table to an image. Blocks that cover a page that is entirely inside of the image use the
+ * fastest implementation the CPU supports, the rest are checked entry by entry.
+ *
+ * @param target The memory to relocate
+ * @param table The relocation table
+ * @param size The size of the table in bytes
+ * @return 0 on success, <0 on error
+ */
+int relocateBlocks(const RelocationTarget* target, const uint8_t* table, size_t size) {
+    static const BlockFunc blockFunc = selectBlockFunc();
+
+    size_t offset = 0;
+    while(size - offset >= sizeof(RelocationBlock)) {
+        RelocationBlock block;
+        memcpy(&block, table + offset, sizeof(block));
+
+        // The table can be padded with an empty block
+        if(block.pageRva == 0 || block.size == 0) {
+            break;
+        }
+        if(block.size < sizeof(block) || block.size > size - offset) {
+            return -EINVAL;
+        }
+
+        auto entries = table + offset + sizeof(block);
+        auto count = (int) ((block.size - sizeof(block)) / sizeof(uint16_t));
+
+        // The largest fixup is 8 bytes and can start at the last byte of the page
+        auto inside = block.pageRva >= target->low &&
+            (uint64_t) block.pageRva + PAGE_SIZE + sizeof(uint64_t) <= target->high;
+        auto result = (inside ? blockFunc : relocateBlockScalar)(target, block.pageRva, entries, count);
+        if(result < 0) return result;
+
+        // The size in the header also counts the header.
+        offset += block.size;
+    }
+
+    return 0;
+}
+
+/**
+ * Applies a base relocation table like relocateBlocks with the blocks spread over a pool of threads. The block headers
+ * are scanned first and the table is cut into pieces with about the same number of entries at block boundaries. Tables
+ * that list a page more than once are applied on the calling thread, since those blocks could race.
+ *
+ * @param target The memory to relocate
+ * @param table The relocation table
+ * @param size The size of the table in bytes
+ * @param threads The most threads to use, the calling thread included
+ * @return 0 on success, <0 on error
+ */
+int relocateBlocksParallel(const RelocationTarget* target, const uint8_t* table, size_t size, int threads) {
+    size_t end = 0;
+    int blockCount = 0;
+    bool sorted = true;
+    uint32_t lastPage = 0;
+    while(size - end >= sizeof(RelocationBlock)) {
+        RelocationBlock block;
+        memcpy(&block, table + end, sizeof(block));
+
+        if(block.pageRva == 0 || block.size == 0) {
+            break;
+        }
+        if(block.size < sizeof(block) || block.size > size - end) {
+            return -EINVAL;
+        }
+
+        sorted &= blockCount == 0 || block.pageRva > lastPage;
+        lastPage = block.pageRva;
+        blockCount++;
+        end += block.size;
+    }
+
+    if(!sorted || threads < 2 || blockCount < 2) {
+        return relocateBlocks(target, table, end);
+    }
+
+    auto chunkCount = blockCount < threads * CHUNKS_PER_THREAD ? blockCount : threads * CHUNKS_PER_THREAD;
+    auto cuts = new size_t[chunkCount + 1];
+    cuts[0] = 0;
+    int chunk = 1;
+    for(size_t offset = 0; offset < end && chunk < chunkCount;) {
+        RelocationBlock block;
+        memcpy(&block, table + offset, sizeof(block));
+        offset += block.size;
+
+        if(offset >= end * chunk / chunkCount) {
+            cuts[chunk++] = offset;
+        }
+    }
+    while(chunk <= chunkCount) {
+        cuts[chunk++] = end;
+    }
+
+    auto result = parallelFor(threads, chunkCount, [&](int index) {
+        return relocateBlocks(target, table + cuts[index], cuts[index + 1] - cuts[index]);
+    });
+
+    delete[] cuts;
+    return result;
+}
+
+/**
+ * Checks the entries of a block against the bounds of the image without applying them.
+ *
+ * @param target The memory the table is for
+ * @param page The RVA of the page
+ * @param entries The entries of the block
+ * @param count The number of entries
+ * @return 0 on success, <0 on error
+ */
+static int checkEntries(const RelocationTarget* target, uint32_t page, const uint8_t* entries, int count) {
+    for(int index = 0; index < count; index++) {
+        auto entry = entryAt(entries, index);
+        auto type = entry >> 12;
+        uint64_t rva = (uint64_t) page + (entry & 0x0FFF);
+
+        auto width = entryWidth(type);
+        if(width < 0) return width;
+        if(width != 0 && (rva < target->low || rva + width > target->high)) {
+            return -EINVAL;
+        }
+        if(type == IMAGE_REL_BASED_HIGHADJ && ++index >= count) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Groups the blocks of a relocation table by the page they are for, so the relocations of a part of the image can be
+ * applied on their own with relocateWindow. Every entry is checked against the bounds of the image here, since the
+ * parts are relocated long after the image was opened when there is no way left to report an error.
+ *
+ * @param target The memory the table is for
+ * @param table The relocation table, it has to outlive the index
+ * @param size The size of the table in bytes
+ * @param index The index to fill in
+ * @return 0 on success, -ENOTSUP if a block is not for a whole page, <0 on error
+ */
+int indexRelocationPages(const RelocationTarget* target, const uint8_t* table, size_t size, RelocationPageIndex* index) {
+    index->pageLow = target->low / PAGE_SIZE;
+    index->pageCount = (target->high + PAGE_SIZE - 1) / PAGE_SIZE - index->pageLow;
+    index->starts = new uint32_t[index->pageCount + 1]();
+    index->blocks = nullptr;
+
+    // Count the blocks of every page first, the counts are turned into the start of every page afterwards
+    uint32_t blockCount = 0;
+    size_t end = 0;
+    int result = 0;
+    while(size - end >= sizeof(RelocationBlock)) {
+        RelocationBlock block;
+        memcpy(&block, table + end, sizeof(block));
+
+        if(block.pageRva == 0 || block.size == 0) {
+            break;
+        }
+        if(block.size < sizeof(block) || block.size > size - end) {
+            result = -EINVAL;
+            break;
+        }
+
+        // Blocks always start at a page, anything else could reach two pages further than the one it starts in
+        auto count = (int) ((block.size - sizeof(block)) / sizeof(uint16_t));
+        if((block.pageRva % PAGE_SIZE) != 0) {
+            result = -ENOTSUP;
+            break;
+        }
+        result = checkEntries(target, block.pageRva, table + end + sizeof(block), count);
+        if(result < 0) break;
+
+        // A block with entries is always inside of the image by now
+        auto page = block.pageRva / PAGE_SIZE;
+        if(count != 0 && page >= index->pageLow && page - index->pageLow < index->pageCount) {
+            index->starts[page - index->pageLow + 1]++;
+            blockCount++;
+        }
+        end += block.size;
+    }
+    if(result < 0) {
+        freeRelocationPageIndex(index);
+        return result;
+    }
+
+    for(uint32_t page = 0; page < index->pageCount; page++) {
+        index->starts[page + 1] += index->starts[page];
+    }
+
+    auto next = new uint32_t[index->pageCount];
+    memcpy(next, index->starts, index->pageCount * sizeof(uint32_t));
+    index->blocks = new uint32_t[blockCount];
+    for(size_t offset = 0; offset < end;) {
+        RelocationBlock block;
+        memcpy(&block, table + offset, sizeof(block));
+
+        // Has to pick the same blocks as the counting pass, or the writes run past the end of the blocks
+        auto count = (int) ((block.size - sizeof(block)) / sizeof(uint16_t));
+        auto page = block.pageRva / PAGE_SIZE;
+        if(count != 0 && page >= index->pageLow && page - index->pageLow < index->pageCount) {
+            index->blocks[next[page - index->pageLow]++] = (uint32_t) offset;
+        }
+        offset += block.size;
+    }
+    delete[] next;
+
+    return 0;
+}
+
+/**
+ * Applies the part of a relocation table that falls inside of a window of the image. The window is usually a copy of a
+ * few pages of the image, a value that is split between the window and the memory around it is skipped. The window
+ * should start and end a few bytes outside of the pages that are used, so the values at their edges are complete.
+ *
+ * @param window The window to relocate, the RVAs from low to high are mapped
+ * @param table The relocation table
+ * @param index The index of the table
+ */
+void relocateWindow(const RelocationTarget* window, const uint8_t* table, const RelocationPageIndex* index) {
+    // The entries of a page can reach into the next page
+    uint64_t first = window->low / PAGE_SIZE;
+    first = first > index->pageLow ? first - 1 : index->pageLow;
+    uint64_t last = (window->high + PAGE_SIZE - 1) / PAGE_SIZE;
+    last = last < index->pageLow + index->pageCount ? last : index->pageLow + index->pageCount;
+
+    for(auto page = first; page < last; page++) {
+        for(auto i = index->starts[page - index->pageLow]; i < index->starts[page - index->pageLow + 1]; i++) {
+            RelocationBlock block;
+            memcpy(&block, table + index->blocks[i], sizeof(block));
+
+            auto count = (int) ((block.size - sizeof(block)) / sizeof(uint16_t));
+            relocateEntries(window, block.pageRva, table + index->blocks[i] + sizeof(block), 0, count, count, true);
+        }
+    }
+}
+
+void freeRelocationPageIndex(RelocationPageIndex* index) {
+    delete[] index->starts;
+    delete[] index->blocks;
+    index->starts = nullptr;
+    index->blocks = nullptr;
+}
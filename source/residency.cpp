@@ -0,0 +1,337 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+}
+
+#include "cache.h"
+#include "pefile.h"
+#include "residency.h"
+
+#define PAGE_SIZE (0x1000)
+#define PAGE_MASK (PAGE_SIZE - 1)
+#define HUGE_PAGE_SIZE (0x200000)
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ (22)
+#endif
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE (25)
+#endif
+
+/**
+ * Gets the page aligned range of a section, partial pages at either end are included.
+ *
+ * @param section The section
+ * @param start The start of the range
+ * @param length The length of the range
+ * @return false if the section is not in memory
+ */
+static bool sectionRange(PeSection* section, uintptr_t* start, size_t* length) {
+    if(section->pointer == nullptr || section->size == 0) {
+        return false;
+    }
+
+    auto pointer = reinterpret_cast<uintptr_t>(section->pointer);
+    *start = pointer & ~(uintptr_t) PAGE_MASK;
+    *length = ((pointer + section->size + PAGE_MASK) & ~(uintptr_t) PAGE_MASK) - *start;
+    return true;
+}
+
+static inline bool isExecutable(PeSection* section) {
+    return (section->characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+}
+
+/**
+ * Maps anonymous memory for an image so that the image base is on a huge page boundary. Sections then line up with huge
+ * pages the same way they would at an image base from the headers, which are normally aligned to 2 MiB or more.
+ *
+ * @param size The size of the memory
+ * @param offset The offset of the memory from the image base
+ * @return The memory or MAP_FAILED
+ */
+void* mapHugeAligned(size_t size, size_t offset) {
+    auto reserved = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(reserved == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    auto start = reinterpret_cast<uintptr_t>(reserved);
+    auto end = start + size + HUGE_PAGE_SIZE;
+    auto aligned = ((start - offset + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1)) + offset;
+    if(aligned > start) {
+        munmap(reserved, aligned - start);
+    }
+    if(aligned + size < end) {
+        munmap(reinterpret_cast<void*>(aligned + size), end - aligned - size);
+    }
+
+    return reinterpret_cast<void*>(aligned);
+}
+
+/**
+ * Asks for transparent huge pages for the executable sections of an image. This has to happen before the sections are
+ * written so the first faults already get huge pages.
+ *
+ * @param file The PE file, the section pointers have to be set
+ */
+void adviseHugePages(PeFile* file) {
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        uintptr_t start;
+        size_t length;
+        if(isExecutable(section) && sectionRange(section, &start, &length)) {
+            // Only advice, the image works the same without huge pages
+            madvise(reinterpret_cast<void*>(start), length, MADV_HUGEPAGE);
+        }
+    }
+}
+
+/**
+ * Faults the pages of a range in for reading. Kernels before 5.14 do not have MADV_POPULATE_READ, every page is touched
+ * instead.
+ *
+ * @param start The start of the range
+ * @param length The length of the range
+ */
+void populate(uintptr_t start, size_t length) {
+    if(madvise(reinterpret_cast<void*>(start), length, MADV_POPULATE_READ) == 0 || errno != EINVAL) {
+        return;
+    }
+
+    for(size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+        (void) *reinterpret_cast<volatile const uint8_t*>(start + offset);
+    }
+}
+
+/**
+ * Faults in the pages of a PE file that were in its recorded working set. Every run of pages is read ahead first so
+ * the reads from the file overlap, then the runs are faulted in. The rest of the image is faulted in on use like always.
+ *
+ * @param file The PE file
+ */
+static void prefetchWorkingSet(PeFile* file) {
+    auto allocation = reinterpret_cast<uintptr_t>(file->sectionAllocation);
+    auto pageCount = file->sectionAllocationSize / PAGE_SIZE;
+    auto pages = new uint8_t[(pageCount + 7) / 8];
+    if(loadWorkingSet(file->workingSet, pages, pageCount) < 0) {
+        delete[] pages;
+        return;
+    }
+
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t page = 0; page < pageCount;) {
+            if((pages[page / 8] & (1 << (page % 8))) == 0) {
+                page++;
+                continue;
+            }
+
+            auto end = page + 1;
+            while(end < pageCount && (pages[end / 8] & (1 << (end % 8))) != 0) {
+                end++;
+            }
+
+            auto start = allocation + page * PAGE_SIZE;
+            auto length = (end - page) * PAGE_SIZE;
+            if(pass == 0) {
+                madvise(reinterpret_cast<void*>(start), length, MADV_WILLNEED);
+            } else {
+                populate(start, length);
+            }
+            page = end;
+        }
+    }
+
+    delete[] pages;
+}
+
+/**
+ * Finds the pages of an image that this process has touched. The page table of the process is read from
+ * /proc/self/pagemap, which unlike mincore does not count pages that are only in the page cache because another
+ * process used them. Without access to it mincore is used instead.
+ *
+ * @param file The PE file
+ * @param pages The bitmap to fill in, a bit per page
+ * @return 0 on success, <0 on error
+ */
+static int residentPages(PeFile* file, uint8_t* pages) {
+    auto allocation = reinterpret_cast<uintptr_t>(file->sectionAllocation);
+    auto pageCount = file->sectionAllocationSize / PAGE_SIZE;
+    memset(pages, 0, (pageCount + 7) / 8);
+
+    auto entries = new uint64_t[pageCount];
+    auto handle = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    auto length = (ssize_t) (pageCount * sizeof(uint64_t));
+    auto complete = handle != -1 && pread64(handle, entries, length, (off64_t) (allocation / PAGE_SIZE * sizeof(uint64_t))) == length;
+    if(handle != -1) {
+        close(handle);
+    }
+
+    if(complete) {
+        // Bit 63 is set for pages that are present, bit 62 for pages that are swapped out
+        for(size_t page = 0; page < pageCount; page++) {
+            if((entries[page] >> 62) != 0) {
+                pages[page / 8] |= 1 << (page % 8);
+            }
+        }
+    } else {
+        auto vector = reinterpret_cast<unsigned char*>(entries);
+        if(mincore(file->sectionAllocation, file->sectionAllocationSize, vector) != 0) {
+            delete[] entries;
+            return -errno;
+        }
+        for(size_t page = 0; page < pageCount; page++) {
+            if((vector[page] & 1) != 0) {
+                pages[page / 8] |= 1 << (page % 8);
+            }
+        }
+    }
+    delete[] entries;
+
+    return 0;
+}
+
+/**
+ * Records the pages of a PE file that have been touched so far as its working set.
+ *
+ * @param file The PE file, it has to have a working set
+ * @return 0 on success, <0 on error
+ */
+int recordWorkingSet(PeFile* file) {
+    auto pageCount = file->sectionAllocationSize / PAGE_SIZE;
+    auto pages = new uint8_t[(pageCount + 7) / 8];
+    auto result = residentPages(file, pages);
+    if(result == 0) {
+        result = storeWorkingSet(file->workingSet, pages, pageCount);
+    }
+    delete[] pages;
+
+    return result;
+}
+
+/**
+ * Applies the memory options to a loaded image, after the memory permissions are set. Everything but locking is only
+ * advice and can not fail.
+ *
+ * @param file The PE file
+ * @param options The options the file was opened with
+ * @return 0 on success, <0 on error
+ */
+int applyResidency(PeFile* file, const PeLoaderOpen* options) {
+    auto memory = &options->memory;
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        uintptr_t start;
+        size_t length;
+        if(!sectionRange(section, &start, &length)) {
+            continue;
+        }
+
+        auto characteristics = section->characteristics;
+        if(memory->hugePages && isExecutable(section)) {
+            // Images that are mapped from a file or were written before the advice get collapsed now
+            madvise(reinterpret_cast<void*>(start), length, MADV_HUGEPAGE);
+            madvise(reinterpret_cast<void*>(start), length, MADV_COLLAPSE);
+        }
+        if(
+            memory->willNeed &&
+            (characteristics & (IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE)) == IMAGE_SCN_MEM_READ
+        ) {
+            madvise(reinterpret_cast<void*>(start), length, MADV_WILLNEED);
+        }
+        if(memory->prefault == PELOADER_PREFAULT_POPULATE && (characteristics & IMAGE_SCN_MEM_READ) != 0) {
+            populate(start, length);
+        }
+    }
+
+    if(file->workingSet != nullptr && memory->prefault == PELOADER_PREFAULT_NONE) {
+        prefetchWorkingSet(file);
+    }
+
+    if(memory->prefault == PELOADER_PREFAULT_LOCK && mlock(file->sectionAllocation, file->sectionAllocationSize) != 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Measures how much of every section is resident and how much of it is backed by huge pages. Residency comes from
+ * mincore. Huge pages are only reported per mapping in /proc/self/smaps, so the huge pages of a mapping are split
+ * between the sections in it by their size.
+ *
+ * @param file The PE file
+ * @param residentBytes The resident bytes of every section
+ * @param hugePageBytes The bytes of every section that are backed by huge pages
+ */
+void measureResidency(PeFile* file, size_t* residentBytes, size_t* hugePageBytes) {
+    auto allocation = reinterpret_cast<uintptr_t>(file->sectionAllocation);
+    auto pageCount = file->sectionAllocationSize / PAGE_SIZE;
+    auto vector = new unsigned char[pageCount];
+    auto haveVector = mincore(file->sectionAllocation, file->sectionAllocationSize, vector) == 0;
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        residentBytes[i] = 0;
+        hugePageBytes[i] = 0;
+
+        uintptr_t start;
+        size_t length;
+        if(!haveVector || !sectionRange(&file->sections[i], &start, &length)) {
+            continue;
+        }
+        for(auto page = (start - allocation) / PAGE_SIZE; page < (start + length - allocation) / PAGE_SIZE; page++) {
+            residentBytes[i] += (vector[page] & 1) != 0 ? PAGE_SIZE : 0;
+        }
+    }
+    delete[] vector;
+
+    auto smaps = fopen("/proc/self/smaps", "re");
+    if(smaps == nullptr) {
+        return;
+    }
+
+    char line[512];
+    uintptr_t mappingStart = 0;
+    uintptr_t mappingEnd = 0;
+    while(fgets(line, sizeof(line), smaps) != nullptr) {
+        unsigned long low;
+        unsigned long high;
+        unsigned long kilobytes;
+        if(sscanf(line, "%lx-%lx ", &low, &high) == 2) {
+            mappingStart = low;
+            mappingEnd = high;
+            continue;
+        }
+        if(
+            sscanf(line, "AnonHugePages: %lu kB", &kilobytes) != 1 &&
+            sscanf(line, "ShmemPmdMapped: %lu kB", &kilobytes) != 1 &&
+            sscanf(line, "FilePmdMapped: %lu kB", &kilobytes) != 1
+        ) {
+            continue;
+        }
+        if(kilobytes == 0 || mappingEnd <= allocation || mappingStart >= allocation + file->sectionAllocationSize) {
+            continue;
+        }
+
+        for(int i = 0; i < file->sectionCount; i++) {
+            uintptr_t start;
+            size_t length;
+            if(!sectionRange(&file->sections[i], &start, &length)) {
+                continue;
+            }
+            auto low = start > mappingStart ? start : mappingStart;
+            auto high = start + length < mappingEnd ? start + length : mappingEnd;
+            if(low < high) {
+                hugePageBytes[i] += (size_t) ((double) kilobytes * 1024 * (high - low) / (mappingEnd - mappingStart));
+            }
+        }
+    }
+    fclose(smaps);
+}
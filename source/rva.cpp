@@ -0,0 +1,186 @@
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+#include "rva.h"
+
+#define PAGE_SHIFT (12)
+
+/**
+ * Sets the sections of a PE file from their headers. The full headers go into the load state, the sections only keep
+ * what is still needed once the file is loaded. The pointers of the sections are left for the caller to fill in.
+ *
+ * @param file The file to set the sections of
+ * @param headers The section headers
+ * @param count The number of section headers
+ */
+void setSections(PeFile* file, const PeSectionHeader* headers, int count) {
+    auto sectionHeaders = new PeSectionHeader[count];
+    memcpy(sectionHeaders, headers, count * sizeof(PeSectionHeader));
+
+    auto sections = new PeSection[count]();
+    for(int i = 0; i < count; i++) {
+        auto section = &sections[i];
+        memcpy(section->name, sectionHeaders[i].name, sizeof(section->name));
+        section->virtualAddress = sectionHeaders[i].virtualAddress;
+        section->characteristics = sectionHeaders[i].characteristics;
+        section->size = sectionHeaders[i].virtualSize;
+    }
+
+    file->load->sectionHeaders = sectionHeaders;
+    file->sections = sections;
+    file->sectionCount = count;
+}
+
+/**
+ * Builds the page table that maps RVAs to sections, before the file is parsed. Files with more sections than fit in
+ * the table only use the linear search.
+ *
+ * @param file The file to build the table for
+ */
+void buildRvaIndex(PeFile* file) {
+    delete[] file->rvaPages;
+    file->rvaPages = nullptr;
+    file->rvaPageLow = 0;
+    file->rvaPageCount = 0;
+
+    if(file->sectionCount > RVA_PAGE_SHARED) {
+        return;
+    }
+
+    uint64_t low = UINT64_MAX;
+    uint64_t high = 0;
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->size == 0) {
+            continue;
+        }
+
+        uint64_t start = section->virtualAddress;
+        low = start < low ? start : low;
+        high = start + section->size > high ? start + section->size : high;
+    }
+    if(low >= high) {
+        return;
+    }
+
+    auto pageLow = (uint32_t) (low >> PAGE_SHIFT);
+    auto pageCount = (uint32_t) (((high - 1) >> PAGE_SHIFT) - pageLow + 1);
+    auto pages = new uint8_t[pageCount];
+    memset(pages, RVA_PAGE_NONE, pageCount);
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->size == 0) {
+            continue;
+        }
+
+        uint64_t start = section->virtualAddress;
+        auto first = (uint32_t) (start >> PAGE_SHIFT) - pageLow;
+        auto last = (uint32_t) ((start + section->size - 1) >> PAGE_SHIFT) - pageLow;
+        for(auto page = first; page <= last; page++) {
+            pages[page] = pages[page] == RVA_PAGE_NONE ? (uint8_t) i : RVA_PAGE_SHARED;
+        }
+    }
+
+    file->rvaPages = pages;
+    file->rvaPageLow = pageLow;
+    file->rvaPageCount = pageCount;
+}
+
+/**
+ * Gets the memory protection flags of a section.
+ *
+ * @param section The section to get the flags of
+ * @return The PROT_ flags of the section
+ */
+int sectionPerms(const PeSection* section) {
+    auto characteristics = section->characteristics;
+    int perms = (characteristics & IMAGE_SCN_MEM_EXECUTE) != 0 ? PROT_EXEC : 0;
+    perms |= (characteristics & IMAGE_SCN_MEM_READ) != 0 ? PROT_READ : 0;
+    perms |= (characteristics & IMAGE_SCN_MEM_WRITE) != 0 ? PROT_WRITE : 0;
+    return perms;
+}
+
+/**
+ * Works out the protection of a page of the image from what is on it. A page never loses a flag that a section on it
+ * asked for:
+ *  - a page that is shared by several sections gets the flags of all of them combined
+ *  - pages that no section covers are read-only
+ *  - the pages of the import address tables are read-only after loading, peloader_import makes them writable for each
+ *    store. They stay writable when the lazy trampolines have to update them, or when they hold code as well, so that
+ *    the code on them keeps running while imports are bound. That is the only case where the loader itself makes a
+ *    page writable and executable at once, it only happens with images that are aligned below the page size.
+ *
+ * @param perms The PROT_ flags of the sections on the page combined
+ * @param covered If any section covers the page
+ * @param importTable If an import address table is on the page
+ * @param lazy If the file has lazy imports
+ * @return The PROT_ flags of the page
+ */
+int pagePerms(int perms, bool covered, bool importTable, bool lazy) {
+    if(!covered) {
+        perms = PROT_READ;
+    }
+    if(importTable && (lazy || (perms & PROT_EXEC) != 0)) {
+        perms |= PROT_WRITE;
+    }
+    return perms;
+}
+
+/**
+ * Gets the lowest RVA of the sections, it is at the start of the section allocation.
+ *
+ * @param file The file to get the start of
+ * @return The lowest RVA, UINT32_MAX if there are no sections
+ */
+uint32_t sectionStart(PeFile* file) {
+    uint32_t start = UINT32_MAX;
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto section = &file->sections[i];
+        if(section->size != 0 && section->virtualAddress < start) {
+            start = section->virtualAddress;
+        }
+    }
+    return start;
+}
+
+/**
+ * Resolves an RVA from a PE file to the section that contains it.
+ *
+ * @param file The file that contains the RVA
+ * @param rva The RVA to resolve
+ * @return The section if found, nullptr if missing
+ */
+PeSection* resolveRvaSection(PeFile* file, uint32_t rva) {
+    if(file->rvaPages != nullptr) {
+        auto page = (rva >> PAGE_SHIFT) - file->rvaPageLow;
+        if(page >= file->rvaPageCount) {
+            return nullptr;
+        }
+
+        auto index = file->rvaPages[page];
+        if(index == RVA_PAGE_NONE) {
+            return nullptr;
+        } else if(index != RVA_PAGE_SHARED) {
+            // The section may only cover part of the page
+            auto current = &file->sections[index];
+            if(current->virtualAddress <= rva && current->virtualAddress + current->size > rva) {
+                return current;
+            }
+            return nullptr;
+        }
+    }
+
+    for(int i = 0; i < file->sectionCount; i++) {
+        auto current = &file->sections[i];
+        if(current->virtualAddress <= rva && current->virtualAddress + current->size > rva) {
+            return current;
+        }
+    }
+
+    return nullptr;
+}
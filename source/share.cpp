@@ -0,0 +1,166 @@
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+}
+
+#include "cache.h"
+#include "demand.h"
+#include "rva.h"
+#include "share.h"
+
+/**
+ * The seals every shared image carries, nothing can change the image once it is shared.
+ */
+#define SHARED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/**
+ * Sets up the shared state of a PE file.
+ *
+ * @param file The PE file
+ * @param handle The memfd of the image, owned by the file afterwards
+ * @param imageOffset The offset of the image in the memfd
+ * @param base The image base that the image in the memfd is relocated for
+ * @param options The options to open instances with
+ */
+static void setShared(PeFile* file, int handle, uint64_t imageOffset, uint64_t base, const PeLoaderOpen* options) {
+    auto shared = new PeSharedImage();
+    shared->handle = handle;
+    shared->imageOffset = imageOffset;
+    shared->base = base;
+    shared->options = *options;
+    file->shared = shared;
+}
+
+/**
+ * Moves the image of a relocated PE file into a sealed memfd, the image is mapped privately from it afterwards. Pages
+ * that are never written are shared between the file and every instance or process that maps the same memfd. Writing
+ * the memfd fills every page of a demand paged image, the image is taken off the pager once it is replaced.
+ *
+ * @param file The PE file to share
+ * @param options The options the file was opened with, they are used again for every instance
+ * @return 0 on success, <0 on error
+ */
+int shareImage(PeFile* file, const PeLoaderOpen* options) {
+    auto size = file->sectionAllocationSize;
+    if(file->sectionAllocation == nullptr) {
+        return -EINVAL;
+    }
+
+    auto handle = memfd_create("peloader", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(handle == -1) {
+        return -errno;
+    }
+
+    uint64_t imageOffset = 0;
+    auto result = writeImageEntry(file, handle, &imageOffset);
+    if(result == 0 && fcntl(handle, F_ADD_SEALS, SHARED_SEALS) != 0) {
+        result = -errno;
+    }
+    if(
+        result == 0 &&
+        mmap(
+            file->sectionAllocation, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, handle, (off64_t) imageOffset
+        ) == MAP_FAILED
+    ) {
+        result = -errno;
+    }
+    if(result < 0) {
+        close(handle);
+        return result;
+    }
+
+    // The mapping that was registered with userfaultfd is gone, no more faults come in for it
+    stopDemandPaging(file);
+    file->stats.demandPaged = 0;
+
+    setShared(file, handle, imageOffset, reinterpret_cast<uintptr_t>(file->sectionAllocation) - sectionStart(file), options);
+
+    return 0;
+}
+
+/**
+ * Maps a new private copy of the image of a shared PE file. The headers are read back from the memfd, the source only
+ * keeps what it needs once it is loaded.
+ *
+ * @param file The new instance
+ * @param source The shared PE file
+ * @param relocateFrom Set to the address the image is relocated for if it has to be relocated again, 0 otherwise
+ * @return 0 on success, <0 on error
+ */
+int mapSharedImage(PeFile* file, PeFile* source, uint64_t* relocateFrom) {
+    uint64_t imageOffset = 0;
+    auto result = mapImageEntry(file, source->shared->handle, &imageOffset, relocateFrom);
+    if(result < 0) return result;
+
+    auto handle = fcntl(source->shared->handle, F_DUPFD_CLOEXEC, 0);
+    if(handle == -1) {
+        return -errno;
+    }
+
+    setShared(file, handle, imageOffset, source->shared->base, &source->shared->options);
+
+    return 0;
+}
+
+/**
+ * Maps the image of a PE file from a handle that was returned by peloader_share, possibly in another process. The image
+ * is mapped at the address it was relocated for when that address is free.
+ *
+ * @param file The PE file to load the image into
+ * @param handle The handle of the shared image, the file keeps its own copy
+ * @param options The options to open instances with
+ * @param relocateFrom Set to the address the image is relocated for if it has to be relocated again, 0 otherwise
+ * @return 0 on success, <0 on error
+ */
+int openSharedImage(PeFile* file, int handle, const PeLoaderOpen* options, uint64_t* relocateFrom) {
+    // Without the seals whoever handed over the memfd could still change the code
+    auto seals = fcntl(handle, F_GET_SEALS);
+    if(seals == -1) {
+        return -errno;
+    }
+    if((seals & SHARED_SEALS) != SHARED_SEALS) {
+        return -EINVAL;
+    }
+
+    uint64_t imageOffset = 0;
+    auto result = mapImageEntry(file, handle, &imageOffset, relocateFrom);
+    if(result < 0) return result;
+
+    auto copy = fcntl(handle, F_DUPFD_CLOEXEC, 0);
+    if(copy == -1) {
+        return -errno;
+    }
+
+    auto base = *relocateFrom != 0 ? *relocateFrom : reinterpret_cast<uintptr_t>(file->sectionAllocation) - sectionStart(file);
+    setShared(file, copy, imageOffset, base, options);
+
+    return 0;
+}
+
+/**
+ * Gets a new handle to the memfd of a shared PE file.
+ *
+ * @param file The shared PE file
+ * @param handle Set to the new handle
+ * @return 0 on success, <0 on error
+ */
+int duplicateSharedImage(PeFile* file, int* handle) {
+    auto copy = fcntl(file->shared->handle, F_DUPFD_CLOEXEC, 0);
+    if(copy == -1) {
+        return -errno;
+    }
+
+    *handle = copy;
+    return 0;
+}
+
+void freeSharedImage(PeFile* file) {
+    if(file->shared != nullptr) {
+        close(file->shared->handle);
+        delete file->shared;
+    }
+}
@@ -0,0 +1,279 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+#include <peloader.h>
+
+/**
+ * Runs a benchmark and returns the average time per iteration in nanoseconds.
+ *
+ * @tparam F The type of the benchmark body
+ * @param rounds The number of times to run the body
+ * @param body The benchmark body
+ * @return The average time per round in nanoseconds
+ */
+template <typename F> static double measure(int rounds, F body) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < rounds; i++) {
+        body();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / rounds;
+}
+
+/**
+ * Compares resolving every named export through peloader_export with a linear strcmp scan over the export list, which
+ * is how peloader_export used to resolve names.
+ */
+static int benchExports(PeFile* file, const char* mode, int rounds) {
+    auto exportCount = peloader_exports(file, nullptr);
+    if(exportCount <= 0) {
+        return exportCount;
+    }
+
+    auto exports = new PeSymbol[exportCount];
+    peloader_exports(file, exports);
+
+    int nameCount = 0;
+    auto names = new const char*[exportCount];
+    for(int i = 0; i < exportCount; i++) {
+        if(exports[i].name != nullptr) {
+            names[nameCount++] = exports[i].name;
+        }
+    }
+
+    size_t misses = 0;
+    auto scan = measure(rounds, [&]() {
+        for(int i = 0; i < nameCount; i++) {
+            void* address = nullptr;
+            for(int o = 0; o < exportCount; o++) {
+                if(exports[o].name != nullptr && strcmp(names[i], exports[o].name) == 0) {
+                    address = exports[o].address;
+                    break;
+                }
+            }
+            misses += address == nullptr;
+        }
+    });
+
+    auto lookup = measure(rounds, [&]() {
+        for(int i = 0; i < nameCount; i++) {
+            PeSymbol symbol = {
+                .name = names[i],
+                .address = nullptr,
+                .ordinal = -1
+            };
+            misses += peloader_export(file, &symbol) != 0;
+        }
+    });
+
+    auto symbols = new PeSymbol[nameCount];
+    auto batch = measure(rounds, [&]() {
+        for(int i = 0; i < nameCount; i++) {
+            symbols[i].name = names[i];
+            symbols[i].address = nullptr;
+            symbols[i].ordinal = -1;
+        }
+        misses += peloader_exportMany(file, symbols, nameCount, nullptr);
+    });
+
+    printf("exports (%s lookup): %d named of %d\n", mode, nameCount, exportCount);
+    printf("  linear scan:         %12.1f ns/name\n", scan / nameCount);
+    printf("  peloader_export:     %12.1f ns/name\n", lookup / nameCount);
+    printf("  peloader_exportMany: %12.1f ns/name\n", batch / nameCount);
+    if(misses != 0) {
+        printf("  misses: %zu\n", misses);
+    }
+
+    delete[] symbols;
+    delete[] names;
+    delete[] exports;
+
+    return 0;
+}
+
+/**
+ * Measures how long opening a file takes with the relocations spread over more and more threads. A copy of the file is
+ * kept open for the whole run so the image base is taken and every open has to apply the relocations.
+ */
+static int benchRelocations(const char* path, int rounds, int maxThreads) {
+    PeLoaderOpen options = {};
+    options.version = PELOADER_OPTIONS_VERSION;
+    options.mode = PELOADER_OPEN_FILE;
+    options.file.path = path;
+    options.relocation.threshold = 1;
+
+    PeFile* holder;
+    auto result = peloader_openEx(&options, &holder);
+    if(result < 0) return result;
+
+    double single = 0;
+    printf("relocations:\n");
+    for(int threads = 1; threads <= maxThreads; threads *= 2) {
+        options.relocation.threads = threads;
+        auto time = measure(rounds, [&]() {
+            PeFile* file;
+            if(peloader_openEx(&options, &file) == 0) {
+                peloader_close(&file);
+            }
+        });
+        if(threads == 1) {
+            single = time;
+        }
+        printf("  %2d thread%s: %12.1f us/open (%.2fx)\n", threads, threads == 1 ? " " : "s", time / 1000, single / time);
+    }
+
+    peloader_close(&holder);
+    return 0;
+}
+
+/**
+ * Compares opening many copies of a file one after the other with opening them all with peloader_openMany.
+ */
+static int benchOpenMany(const char* path, int rounds) {
+    const int count = 16;
+    PeLoaderOpen options[count] = {};
+    for(auto& current : options) {
+        current.version = PELOADER_OPTIONS_VERSION;
+        current.mode = PELOADER_OPEN_FILE;
+        current.file.path = path;
+    }
+    PeFile* files[count];
+    int failures = 0;
+
+    auto sequential = measure(rounds, [&]() {
+        for(int i = 0; i < count; i++) {
+            failures += peloader_openEx(&options[i], &files[i]) != 0;
+        }
+        for(auto& file : files) {
+            peloader_close(&file);
+        }
+    });
+
+    auto batch = measure(rounds, [&]() {
+        failures += peloader_openMany(options, count, files, nullptr);
+        for(auto& file : files) {
+            peloader_close(&file);
+        }
+    });
+
+    printf("opening %d files:\n", count);
+    printf("  peloader_openEx:   %12.1f us\n", sequential / 1000);
+    printf("  peloader_openMany: %12.1f us (%.2fx)\n", batch / 1000, sequential / batch);
+    if(failures != 0) {
+        printf("  failures: %d\n", failures);
+    }
+
+    return 0;
+}
+
+/**
+ * Compares opening a file with the sections read up front and with the pages filled on first touch, once for the open
+ * alone and once with every sixteenth page of the image touched afterwards.
+ */
+static int benchDemandPaging(const char* path, int rounds) {
+    PeLoaderOpen options = {};
+    options.version = PELOADER_OPTIONS_VERSION;
+    options.mode = PELOADER_OPEN_FILE;
+    options.file.path = path;
+
+    printf("demand paging:\n");
+    for(int demand = 0; demand < 2; demand++) {
+        options.demandPaging = demand;
+
+        int failures = 0;
+        int demandPaged = 0;
+        double times[2];
+        for(int touch = 0; touch < 2; touch++) {
+            times[touch] = measure(rounds, [&]() {
+                PeFile* file;
+                if(peloader_openEx(&options, &file) != 0) {
+                    failures++;
+                    return;
+                }
+
+                PeLoaderStats stats = {};
+                stats.version = PELOADER_STATS_VERSION;
+                peloader_stats(file, &stats);
+                demandPaged = stats.demandPaged;
+
+                auto count = touch ? peloader_sections(file, nullptr) : 0;
+                if(count > 0) {
+                    auto sections = new PeSectionInfo[count];
+                    peloader_sections(file, sections);
+                    for(int i = 0; i < count; i++) {
+                        if((sections[i].protection & PROT_READ) == 0) {
+                            continue;
+                        }
+                        for(size_t offset = 0; offset < sections[i].size; offset += 16 * 0x1000) {
+                            (void) *reinterpret_cast<volatile const char*>(static_cast<char*>(sections[i].address) + offset);
+                        }
+                    }
+                    delete[] sections;
+                }
+
+                peloader_close(&file);
+            });
+        }
+
+        printf(
+            "  %-9s open: %12.1f us, open and touch: %12.1f us\n",
+            demandPaged ? "on demand" : "up front",
+            times[0] / 1000,
+            times[1] / 1000
+        );
+        if(failures != 0) {
+            printf("  failures: %d\n", failures);
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        return EINVAL;
+    }
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    int maxThreads = argc > 3 ? atoi(argv[3]) : (int) std::thread::hardware_concurrency();
+
+    PeLoaderOpen options = {};
+    options.version = PELOADER_OPTIONS_VERSION;
+    options.mode = PELOADER_OPEN_FILE;
+    options.file.path = argv[1];
+
+    struct {
+        const char* name;
+        PeExportLookup lookup;
+    } modes[] = {
+        {"index", PELOADER_EXPORT_LOOKUP_INDEX},
+        {"native", PELOADER_EXPORT_LOOKUP_NATIVE},
+    };
+    for(auto& mode : modes) {
+        options.exportLookup = mode.lookup;
+
+        PeFile* file;
+        auto result = peloader_openEx(&options, &file);
+        if(result < 0) return result;
+
+        result = benchExports(file, mode.name, rounds);
+
+        peloader_close(&file);
+        if(result < 0) return result;
+    }
+
+    auto result = benchOpenMany(argv[1], rounds);
+    if(result < 0) return result;
+
+    result = benchDemandPaging(argv[1], rounds);
+    if(result < 0) return result;
+
+    return benchRelocations(argv[1], rounds, maxThreads);
+}
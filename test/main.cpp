@@ -1,6 +1,23 @@
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csetjmp>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <peloader.h>
 
@@ -8,6 +25,1111 @@ PE_FUNC size_t winStrlen(const char* string) {
     return strlen(string);
 }
 
+PE_FUNC size_t winStrlenDoubled(const char* string) {
+    return strlen(string) * 2;
+}
+
+/**
+ * Runs queries and calls through the import address table on many threads while the strlen import is bound back and
+ * forth between two functions. Every call has to end up in one of the two.
+ *
+ * @param file The PE file to test, it has to export importTest
+ * @param threads The number of reader threads
+ * @param rounds The number of rounds per thread
+ * @return The number of failures
+ */
+static int stressTest(PeFile* file, int threads, int rounds) {
+    std::atomic<int> failures(0);
+    std::atomic<bool> running(true);
+    std::atomic<int> binds(0);
+
+    std::thread writer([&]() {
+        PeSymbol function = {
+            .name = "strlen",
+            .address = nullptr,
+            .ordinal = -1
+        };
+        for(int i = 0; running.load(std::memory_order_relaxed); i++) {
+            function.address = reinterpret_cast<void*>(i % 2 == 0 ? winStrlenDoubled : winStrlen);
+            if(peloader_import(file, "msvcrt.dll", &function) != 0) {
+                failures++;
+            }
+            binds.store(i + 1, std::memory_order_relaxed);
+        }
+    });
+
+    std::vector<std::thread> readers;
+    for(int i = 0; i < threads; i++) {
+        readers.emplace_back([&]() {
+            auto importCount = peloader_imports(file, "msvcrt.dll", nullptr);
+            auto imports = new PeSymbol[importCount > 0 ? importCount : 1];
+
+            while(binds.load(std::memory_order_relaxed) == 0) {
+                std::this_thread::yield();
+            }
+
+            for(int o = 0; o < rounds; o++) {
+                PeSymbol function = {
+                    .name = "importTest",
+                    .address = nullptr,
+                    .ordinal = -1
+                };
+                if(peloader_export(file, &function) != 0 || peloader_imports(file, "msvcrt.dll", imports) != importCount) {
+                    failures++;
+                    continue;
+                }
+
+                auto importTest = reinterpret_cast<size_t (PE_FUNC *)(const char*)>(function.address);
+                auto length = importTest("string!");
+                if(length != 7 && length != 14) {
+                    failures++;
+                }
+
+                // Let the writer run now and then, with fewer cores than threads it could otherwise starve
+                if(o % 1024 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+
+            delete[] imports;
+        });
+    }
+
+    for(auto& reader : readers) {
+        reader.join();
+    }
+    running = false;
+    writer.join();
+
+    return failures.load();
+}
+
+/**
+ * Gets the function that the strlen import of a file is bound to by calling importTest through it.
+ *
+ * @param file The PE file, it has to export importTest
+ * @return The length importTest returns for "string!", 0 if it is missing
+ */
+static size_t callImportTest(PeFile* file) {
+    PeSymbol function = {
+        .name = "importTest",
+        .address = nullptr,
+        .ordinal = -1
+    };
+    if(peloader_export(file, &function) != 0) {
+        return 0;
+    }
+    return reinterpret_cast<size_t (PE_FUNC *)(const char*)>(function.address)("string!");
+}
+
+/**
+ * Binds strlen, the import of the test files, to winStrlen.
+ */
+static PeImportBinding strlenBindings[] = {
+    {"msvcrt.dll", {"strlen", reinterpret_cast<void*>(winStrlen), -1}},
+};
+
+/**
+ * Gets the options to open a test file from disk with, tests only set what they check on top of these.
+ *
+ * @param path The path of the PE file to test
+ * @param bindings The binding of strlen or nullptr to leave it to the test
+ * @return The options
+ */
+static PeLoaderOpen testOptions(const char* path, PeImportBinding* bindings) {
+    PeLoaderOpen options = {};
+    options.version = PELOADER_OPTIONS_VERSION;
+    options.mode = PELOADER_OPEN_FILE;
+    options.file.path = path;
+    options.imports.bindings = bindings;
+    options.imports.bindingCount = bindings != nullptr ? 1 : 0;
+    return options;
+}
+
+/**
+ * Binds strlen while the file is loaded. The binding table is applied before the resolver, the resolver sees what the
+ * table bound and only fills in the rest, and peloader_import can still bind again afterwards.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int importBindingTest(const char* path) {
+    int failures = 0;
+
+    PeImportBinding bindings[] = {
+        {"msvcrt.dll", {"strlen", reinterpret_cast<void*>(winStrlenDoubled), -1}},
+    };
+
+    auto options = testOptions(path, bindings);
+    options.imports.resolver = [](const char* module, PeSymbol* symbols, int count, void* user) -> int {
+        for(int i = 0; i < count; i++) {
+            auto symbol = &symbols[i];
+            if(strcmp(module, "msvcrt.dll") != 0 || symbol->name == nullptr || strcmp(symbol->name, "strlen") != 0) {
+                continue;
+            }
+            if(symbol->address == nullptr) {
+                symbol->address = reinterpret_cast<void*>(winStrlen);
+            } else if(symbol->address == reinterpret_cast<void*>(winStrlenDoubled)) {
+                (*static_cast<int*>(user))++;
+            }
+        }
+        return 0;
+    };
+    int tableBound = 0;
+    options.imports.user = &tableBound;
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    failures += tableBound != 1;
+    failures += callImportTest(file) != 14;
+
+    PeSymbol function = {
+        .name = "strlen",
+        .address = reinterpret_cast<void*>(winStrlen),
+        .ordinal = -1
+    };
+    failures += peloader_import(file, "msvcrt.dll", &function) != 0;
+    failures += callImportTest(file) != 7;
+    peloader_close(&file);
+
+    // Without the table the resolver binds it
+    options.imports.bindingCount = 0;
+    tableBound = 0;
+    if(peloader_openEx(&options, &file) != 0) {
+        return failures + 1;
+    }
+    failures += tableBound != 0;
+    failures += callImportTest(file) != 7;
+    peloader_close(&file);
+
+    // A resolver error fails the open with that error
+    options.imports.resolver = [](const char*, PeSymbol*, int, void*) -> int {
+        return -ENOENT;
+    };
+    failures += peloader_openEx(&options, &file) != -ENOENT;
+
+    return failures;
+}
+
+/**
+ * Binds strlen lazily. The resolver runs on the first call through the import and not again, and imports that are bound
+ * while loading never reach it.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int lazyImportTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, nullptr);
+    options.lazyImports.resolver = [](const char* module, const PeSymbol* symbol, void* user) -> void* {
+        if(strcmp(module, "msvcrt.dll") != 0 || symbol->name == nullptr || strcmp(symbol->name, "strlen") != 0) {
+            return nullptr;
+        }
+        (*static_cast<int*>(user))++;
+        return reinterpret_cast<void*>(winStrlen);
+    };
+    int calls = 0;
+    options.lazyImports.user = &calls;
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    failures += calls != 0;
+    failures += callImportTest(file) != 7;
+    failures += callImportTest(file) != 7;
+    failures += calls != 1;
+    peloader_close(&file);
+
+    PeImportBinding bindings[] = {
+        {"msvcrt.dll", {"strlen", reinterpret_cast<void*>(winStrlenDoubled), -1}},
+    };
+    options.imports.bindings = bindings;
+    options.imports.bindingCount = 1;
+    calls = 0;
+    if(peloader_openEx(&options, &file) != 0) {
+        return failures + 1;
+    }
+    failures += callImportTest(file) != 14;
+    failures += calls != 0;
+    peloader_close(&file);
+
+    return failures;
+}
+
+/**
+ * Calls testFunc of a file.
+ *
+ * @param file The PE file, it has to export testFunc
+ * @return The string testFunc returns, an empty string if it is missing
+ */
+static const char* callTestFunc(PeFile* file) {
+    PeSymbol function = {
+        .name = "testFunc",
+        .address = nullptr,
+        .ordinal = -1
+    };
+    if(peloader_export(file, &function) != 0) {
+        return "";
+    }
+    return reinterpret_cast<const char* (PE_FUNC *)()>(function.address)();
+}
+
+/**
+ * Gets the names of the files in a directory that end with a suffix.
+ *
+ * @param path The directory
+ * @param suffix The suffix to match, an empty string matches every file
+ * @return The names of the files
+ */
+static std::vector<std::string> listDirectory(const std::string& path, const char* suffix) {
+    std::vector<std::string> names;
+    auto directory = opendir(path.c_str());
+    if(directory == nullptr) {
+        return names;
+    }
+
+    auto suffixLength = strlen(suffix);
+    for(auto entry = readdir(directory); entry != nullptr; entry = readdir(directory)) {
+        std::string name = entry->d_name;
+        if(name == "." || name == "..") {
+            continue;
+        }
+        if(name.size() >= suffixLength && name.compare(name.size() - suffixLength, suffixLength, suffix) == 0) {
+            names.push_back(name);
+        }
+    }
+    closedir(directory);
+    return names;
+}
+
+/**
+ * Removes a directory that was created for a test and everything in it.
+ *
+ * @param path The directory to remove
+ */
+static void removeDirectory(const std::string& path) {
+    for(auto& name : listDirectory(path, "")) {
+        unlink((path + "/" + name).c_str());
+    }
+    rmdir(path.c_str());
+}
+
+/**
+ * Opens a file through the image cache. The first open writes the entry, the next one maps it back and has to behave
+ * the same even though the address of the entry is still taken by the first open. Files that miss at the same time on
+ * several threads have to leave a single entry and no temporary files behind.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int imageCacheTest(const char* path) {
+    char directory[] = "/tmp/peloader-cache.XXXXXX";
+    if(mkdtemp(directory) == nullptr) {
+        return 1;
+    }
+
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+    options.cacheDirectory = directory;
+
+    PeLoaderStats stats = {};
+    stats.version = PELOADER_STATS_VERSION;
+
+    PeFile* first;
+    PeFile* second;
+    if(peloader_openEx(&options, &first) != 0) {
+        removeDirectory(directory);
+        return 1;
+    }
+    failures += peloader_stats(first, &stats) != 0 || stats.cacheHit;
+    failures += listDirectory(directory, ".pecache").size() != 1;
+
+    if(peloader_openEx(&options, &second) != 0) {
+        failures++;
+    } else {
+        failures += peloader_stats(second, &stats) != 0 || !stats.cacheHit;
+        failures += strcmp(callTestFunc(second), callTestFunc(first)) != 0;
+        failures += callImportTest(second) != 7;
+        peloader_close(&second);
+    }
+    peloader_close(&first);
+    removeDirectory(directory);
+
+    // Concurrent misses of the same file
+    if(mkdtemp(strcpy(directory, "/tmp/peloader-cache.XXXXXX")) == nullptr) {
+        return failures + 1;
+    }
+
+    std::atomic<int> openFailures(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 8; i++) {
+        threads.emplace_back([&]() {
+            PeFile* file;
+            if(peloader_openEx(&options, &file) != 0) {
+                openFailures++;
+                return;
+            }
+            openFailures += strcmp(callTestFunc(file), "This string is inside of the DLL.") != 0;
+            peloader_close(&file);
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    failures += openFailures.load();
+    failures += listDirectory(directory, "").size() != 1;
+    failures += listDirectory(directory, ".pecache").size() != 1;
+
+    if(peloader_openEx(&options, &first) != 0) {
+        failures++;
+    } else {
+        failures += peloader_stats(first, &stats) != 0 || !stats.cacheHit;
+        peloader_close(&first);
+    }
+    removeDirectory(directory);
+
+    return failures;
+}
+
+/**
+ * Gets the address of an export of a file.
+ *
+ * @param file The PE file
+ * @param name The name of the export
+ * @return The address of the export, nullptr if it is missing
+ */
+static void* exportAddress(PeFile* file, const char* name) {
+    PeSymbol function = {
+        .name = name,
+        .address = nullptr,
+        .ordinal = -1
+    };
+    peloader_export(file, &function);
+    return function.address;
+}
+
+/**
+ * Creates instances of a shareable file. Every instance is mapped at its own address and has its own import bindings,
+ * instances can be instantiated themselves and outlive the file they came from.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int instantiateTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+
+    PeFile* file;
+    PeFile* instances[2] = {};
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    failures += peloader_instantiate(file, &instances[0]) != -EINVAL;
+    peloader_close(&file);
+
+    options.shareable = 1;
+    if(peloader_openEx(&options, &file) != 0) {
+        return failures + 1;
+    }
+    for(auto& instance : instances) {
+        if(peloader_instantiate(file, &instance) != 0) {
+            peloader_close(&instances[0]);
+            peloader_close(&file);
+            return failures + 1;
+        }
+        failures += exportAddress(instance, "testFunc") == exportAddress(file, "testFunc");
+        failures += strcmp(callTestFunc(instance), callTestFunc(file)) != 0;
+        failures += callImportTest(instance) != 7;
+    }
+    failures += exportAddress(instances[0], "testFunc") == exportAddress(instances[1], "testFunc");
+
+    // Binding an import of one instance leaves the others alone
+    PeSymbol function = {
+        .name = "strlen",
+        .address = reinterpret_cast<void*>(winStrlenDoubled),
+        .ordinal = -1
+    };
+    failures += peloader_import(instances[0], "msvcrt.dll", &function) != 0;
+    failures += callImportTest(instances[0]) != 14;
+    failures += callImportTest(instances[1]) != 7;
+    failures += callImportTest(file) != 7;
+
+    // Instances outlive the file and can be instantiated themselves
+    peloader_close(&file);
+    PeFile* nested;
+    if(peloader_instantiate(instances[1], &nested) != 0) {
+        failures++;
+    } else {
+        failures += strcmp(callTestFunc(nested), "This string is inside of the DLL.") != 0;
+        failures += callImportTest(nested) != 7;
+        peloader_close(&nested);
+    }
+    failures += callImportTest(instances[0]) != 14;
+
+    peloader_close(&instances[0]);
+    peloader_close(&instances[1]);
+
+    return failures;
+}
+
+/**
+ * Opens a file from a handle returned by peloader_share, in this process where the image address is taken and in a
+ * forked child. Handles that are not sealed images are rejected.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int shareTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+
+    PeFile* file;
+    int handle = -1;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    failures += peloader_share(file, &handle) != -EINVAL;
+    peloader_close(&file);
+
+    options.shareable = 1;
+    if(peloader_openEx(&options, &file) != 0) {
+        return failures + 1;
+    }
+    if(peloader_share(file, &handle) != 0) {
+        peloader_close(&file);
+        return failures + 1;
+    }
+
+    PeLoaderOpen sharedOptions = options;
+    sharedOptions.mode = PELOADER_OPEN_SHARED;
+    sharedOptions.file.handle = handle;
+
+    PeFile* shared;
+    if(peloader_openEx(&sharedOptions, &shared) != 0) {
+        failures++;
+    } else {
+        failures += exportAddress(shared, "testFunc") == exportAddress(file, "testFunc");
+        failures += strcmp(callTestFunc(shared), callTestFunc(file)) != 0;
+        failures += callImportTest(shared) != 7;
+        peloader_close(&shared);
+    }
+
+    auto child = fork();
+    if(child == 0) {
+        // The child binds its own imports
+        PeImportBinding bindings[] = {
+            {"msvcrt.dll", {"strlen", reinterpret_cast<void*>(winStrlenDoubled), -1}},
+        };
+        sharedOptions.imports.bindings = bindings;
+        if(peloader_openEx(&sharedOptions, &shared) != 0) {
+            _exit(1);
+        }
+        auto childFailures = strcmp(callTestFunc(shared), "This string is inside of the DLL.") != 0;
+        childFailures += callImportTest(shared) != 14;
+        peloader_close(&shared);
+        _exit(childFailures);
+    }
+    int status = 0;
+    failures += child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    failures += callImportTest(file) != 7;
+
+    close(handle);
+    peloader_close(&file);
+
+    // A memfd that can still be written to is not a shared image
+    sharedOptions.file.handle = memfd_create("peloader-test", MFD_CLOEXEC);
+    failures += sharedOptions.file.handle < 0;
+    failures += peloader_openEx(&sharedOptions, &shared) == 0;
+    close(sharedOptions.file.handle);
+
+    // Sharing replaces the pages of a demand paged image with the memfd, the pager is done with it
+    options.demandPaging = 1;
+    if(peloader_openEx(&options, &file) != 0) {
+        return failures + 1;
+    }
+    PeLoaderStats stats = {};
+    stats.version = PELOADER_STATS_VERSION;
+    failures += peloader_stats(file, &stats) != 0 || stats.demandPaged;
+    failures += strcmp(callTestFunc(file), "This string is inside of the DLL.") != 0;
+    failures += callImportTest(file) != 7;
+    peloader_close(&file);
+
+    return failures;
+}
+
+/**
+ * Opens a file with deduplicate. Opens of a file that is already open return the same PeFile until the last one is
+ * closed, on any thread, and opens without the option are not affected.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int deduplicateTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+    options.deduplicate = 1;
+
+    PeFile* first;
+    PeFile* second;
+    PeFile* plain;
+    if(peloader_openEx(&options, &first) != 0) {
+        return 1;
+    }
+    if(peloader_openEx(&options, &second) != 0) {
+        peloader_close(&first);
+        return 1;
+    }
+    failures += first != second;
+
+    options.deduplicate = 0;
+    if(peloader_openEx(&options, &plain) != 0) {
+        failures++;
+    } else {
+        failures += plain == first;
+        peloader_close(&plain);
+    }
+    options.deduplicate = 1;
+
+    // The file stays open until its last holder closes it
+    auto holder = first;
+    peloader_close(&second);
+    failures += callImportTest(holder) != 7;
+
+    std::atomic<int> threadFailures(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 8; i++) {
+        threads.emplace_back([&]() {
+            for(int o = 0; o < 100; o++) {
+                PeFile* file;
+                if(peloader_openEx(&options, &file) != 0) {
+                    threadFailures++;
+                    continue;
+                }
+                threadFailures += file != holder;
+                peloader_close(&file);
+            }
+        });
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    failures += threadFailures.load();
+    failures += strcmp(callTestFunc(holder), "This string is inside of the DLL.") != 0;
+
+    // Files are not opened through symlinks, so a link to an open file must neither open nor share it
+    char directory[] = "/tmp/peloader-link.XXXXXX";
+    if(mkdtemp(directory) == nullptr) {
+        failures++;
+    } else {
+        char resolved[PATH_MAX];
+        auto link = std::string(directory) + "/link.dll";
+        if(realpath(path, resolved) == nullptr || symlink(resolved, link.c_str()) != 0) {
+            failures++;
+        } else {
+            PeFile* linked = nullptr;
+            options.file.path = link.c_str();
+            failures += peloader_openEx(&options, &linked) != -ELOOP;
+            failures += linked == holder;
+            options.file.path = path;
+        }
+        removeDirectory(directory);
+    }
+    peloader_close(&first);
+
+    return failures;
+}
+
+/**
+ * Opens a batch of files with peloader_openMany, where some of them fail. Every file gets its own result and the
+ * failures do not affect the others.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int openManyTest(const char* path) {
+    int failures = 0;
+
+    PeLoaderOpen options[8];
+    for(auto& option : options) {
+        option = testOptions(path, strlenBindings);
+    }
+    options[2].file.path = "/nonexistent/peloader-test.dll";
+    options[5].version = 0;
+
+    PeFile* files[8];
+    int errors[8];
+    failures += peloader_openMany(options, 8, files, errors) != 2;
+    for(int i = 0; i < 8; i++) {
+        if(i == 2) {
+            failures += errors[i] != -ENOENT || files[i] != nullptr;
+        } else if(i == 5) {
+            failures += errors[i] != -EINVAL || files[i] != nullptr;
+        } else if(errors[i] != 0 || files[i] == nullptr) {
+            failures++;
+        } else {
+            failures += callImportTest(files[i]) != 7;
+            peloader_close(&files[i]);
+        }
+    }
+
+    failures += peloader_openMany(options, 0, files, nullptr) != 0;
+    failures += peloader_openMany(options, 1, nullptr, nullptr) != -EINVAL;
+
+    return failures;
+}
+
+/**
+ * The result of an asynchronous open in openAsyncTest.
+ */
+typedef struct {
+    std::mutex lock;
+    std::condition_variable finished;
+    int calls;
+    int result;
+    PeFile* file;
+    PeOpenTask* task;
+} AsyncOpen;
+
+/**
+ * Waits for an asynchronous open of openAsyncTest to finish.
+ *
+ * @param open The open to wait for
+ */
+static void waitForOpen(AsyncOpen* open) {
+    std::unique_lock<std::mutex> guard(open->lock);
+    open->finished.wait(guard, [&]() {
+        return open->calls != 0;
+    });
+}
+
+/**
+ * Opens files with peloader_openAsync. The callback is invoked exactly once with the file or the error, a cancelled
+ * open either finishes or reports -ECANCELED, and options that are not valid fail right away without a callback.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int openAsyncTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+
+    PeOpenCallback callback = [](int result, PeFile* file, void* user) {
+        auto open = static_cast<AsyncOpen*>(user);
+        std::lock_guard<std::mutex> guard(open->lock);
+        open->calls++;
+        open->result = result;
+        open->file = file;
+        // Releasing from the callback is allowed
+        if(open->task != nullptr) {
+            peloader_releaseOpen(&open->task);
+        }
+        open->finished.notify_all();
+    };
+
+    AsyncOpen opened = {};
+    PeOpenTask* task = nullptr;
+    if(peloader_openAsync(&options, callback, &opened, &task) != 0) {
+        return 1;
+    }
+    waitForOpen(&opened);
+    peloader_releaseOpen(&task);
+    failures += task != nullptr;
+    failures += opened.result != 0 || opened.file == nullptr;
+    if(opened.file != nullptr) {
+        failures += callImportTest(opened.file) != 7;
+        peloader_close(&opened.file);
+    }
+
+    // The task is released by the callback, the lock keeps it from running before the task is stored
+    AsyncOpen released = {};
+    {
+        std::lock_guard<std::mutex> guard(released.lock);
+        failures += peloader_openAsync(&options, callback, &released, &released.task) != 0;
+    }
+    waitForOpen(&released);
+    failures += released.task != nullptr || released.result != 0;
+    peloader_close(&released.file);
+
+    AsyncOpen cancelled[8] = {};
+    for(auto& open : cancelled) {
+        if(peloader_openAsync(&options, callback, &open, &task) != 0) {
+            failures++;
+            open.calls = 1;
+            continue;
+        }
+        peloader_cancelOpen(task);
+        peloader_releaseOpen(&task);
+    }
+    for(auto& open : cancelled) {
+        waitForOpen(&open);
+        if(open.result == -ECANCELED) {
+            failures += open.file != nullptr;
+        } else {
+            failures += open.result != 0 || open.file == nullptr;
+            peloader_close(&open.file);
+        }
+    }
+
+    AsyncOpen missing = {};
+    options.file.path = "/nonexistent/peloader-test.dll";
+    failures += peloader_openAsync(&options, callback, &missing, nullptr) != 0;
+    waitForOpen(&missing);
+    failures += missing.result != -ENOENT || missing.file != nullptr;
+
+    AsyncOpen invalid = {};
+    options.version = 0;
+    failures += peloader_openAsync(&options, callback, &invalid, nullptr) != -EINVAL;
+    failures += invalid.calls != 0;
+
+    // Every callback has run once, and only once
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    failures += opened.calls != 1 || released.calls != 1 || missing.calls != 1;
+    for(auto& open : cancelled) {
+        failures += open.calls != 1;
+    }
+
+    return failures;
+}
+
+/**
+ * Checks that every readable section of a file is resident.
+ *
+ * @param file The PE file to check
+ * @return The number of sections that are not resident
+ */
+static int checkResident(PeFile* file) {
+    auto count = peloader_sections(file, nullptr);
+    if(count <= 0) {
+        return 1;
+    }
+
+    int failures = 0;
+    auto sections = new PeSectionInfo[count];
+    peloader_sections(file, sections);
+    for(int i = 0; i < count; i++) {
+        auto section = &sections[i];
+        // Sections of images that are aligned below the page size can start in the middle of a page
+        auto start = reinterpret_cast<uintptr_t>(section->address) & ~(uintptr_t) 0xFFF;
+        auto end = (reinterpret_cast<uintptr_t>(section->address) + section->size + 0xFFF) & ~(uintptr_t) 0xFFF;
+        if((section->protection & PROT_READ) != 0) {
+            failures += section->residentBytes != end - start;
+        }
+        failures += section->hugePageBytes > section->residentBytes;
+    }
+    delete[] sections;
+    return failures;
+}
+
+/**
+ * Opens a file with the memory options. Prefaulting makes every readable section resident, and with huge pages an
+ * image that can not get its image base is placed on a 2 MiB boundary. Whether the kernel hands out huge pages depends
+ * on the system, so only the placement is checked.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int memoryOptionsTest(const char* path) {
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+    options.memory.prefault = PELOADER_PREFAULT_POPULATE;
+    options.memory.willNeed = 1;
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    failures += checkResident(file);
+    failures += callImportTest(file) != 7;
+
+    // The first file holds the image base
+    PeFile* huge[2] = {};
+    options.memory.hugePages = 1;
+    for(auto& hugeFile : huge) {
+        if(peloader_openEx(&options, &hugeFile) != 0) {
+            failures++;
+            continue;
+        }
+        failures += checkResident(hugeFile);
+        failures += callImportTest(hugeFile) != 7;
+    }
+    if(huge[0] != nullptr && huge[1] != nullptr) {
+        auto distance = reinterpret_cast<uintptr_t>(exportAddress(huge[1], "testFunc")) -
+            reinterpret_cast<uintptr_t>(exportAddress(huge[0], "testFunc"));
+        failures += (distance & 0x1FFFFF) != 0;
+    }
+    peloader_close(&huge[0]);
+    peloader_close(&huge[1]);
+    peloader_close(&file);
+
+    // Locking can fail when the image is larger than the lock limit
+    options.memory.hugePages = 0;
+    options.memory.prefault = PELOADER_PREFAULT_LOCK;
+    auto result = peloader_openEx(&options, &file);
+    if(result == 0) {
+#ifndef __SANITIZE_ADDRESS__
+        // AddressSanitizer turns mlock into a no-op
+        failures += checkResident(file);
+#endif
+        failures += callImportTest(file) != 7;
+        peloader_close(&file);
+    } else {
+        failures += result != -ENOMEM && result != -EPERM && result != -EAGAIN;
+    }
+
+    return failures;
+}
+
+/**
+ * Opens a file with a working set profile. Only an image that is mapped from the image cache gets a profile, it is
+ * written by peloader_recordWorkingSet and the next open of the file loads it.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int workingSetTest(const char* path) {
+    char directory[] = "/tmp/peloader-profile.XXXXXX";
+    if(mkdtemp(directory) == nullptr) {
+        return 1;
+    }
+
+    int failures = 0;
+
+    auto options = testOptions(path, strlenBindings);
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        removeDirectory(directory);
+        return 1;
+    }
+    failures += peloader_recordWorkingSet(file) != -EINVAL;
+    peloader_close(&file);
+
+    // The first open copies the image into the cache, it has every page present so it does not get a profile
+    options.cacheDirectory = directory;
+    options.workingSet = 1;
+    for(int i = 0; i < 3; i++) {
+        if(peloader_openEx(&options, &file) != 0) {
+            failures++;
+            continue;
+        }
+        failures += callImportTest(file) != 7;
+        auto result = peloader_recordWorkingSet(file);
+        failures += i == 0 ? result != -EINVAL : result != 0;
+        failures += listDirectory(directory, ".peprofile").size() != (i == 0 ? 0 : 1);
+        peloader_close(&file);
+    }
+    failures += listDirectory(directory, ".peprofile").size() != 1;
+    failures += listDirectory(directory, "").size() != 2;
+
+    removeDirectory(directory);
+    return failures;
+}
+
+/**
+ * Copies a file.
+ *
+ * @param from The path of the file to copy
+ * @param to The path of the copy
+ * @return true on success
+ */
+static bool copyFile(const char* from, const char* to) {
+    auto source = fopen(from, "rb");
+    if(source == nullptr) {
+        return false;
+    }
+    auto target = fopen(to, "wb");
+    if(target == nullptr) {
+        fclose(source);
+        return false;
+    }
+
+    char buffer[65536];
+    size_t length;
+    auto copied = true;
+    while((length = fread(buffer, 1, sizeof(buffer), source)) != 0) {
+        copied &= fwrite(buffer, 1, length, target) == length;
+    }
+    fclose(source);
+    return fclose(target) == 0 && copied;
+}
+
+static sigjmp_buf demandFault;
+
+/**
+ * Fails a page of a demand paged file. When the page can not be read from the file the thread that touched it gets
+ * SIGBUS, like it would with a mapped file, and the process keeps running if it handles the signal. Without
+ * userfaultfd the file is read when it is opened and there is nothing to test.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int demandFailureTest(const char* path) {
+    char directory[] = "/tmp/peloader-demand.XXXXXX";
+    if(mkdtemp(directory) == nullptr) {
+        return 1;
+    }
+    auto copy = std::string(directory) + "/copy.dll";
+    if(!copyFile(path, copy.c_str())) {
+        removeDirectory(directory);
+        return 1;
+    }
+
+    auto options = testOptions(copy.c_str(), strlenBindings);
+    options.demandPaging = 1;
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        removeDirectory(directory);
+        return 1;
+    }
+
+    int failures = 0;
+    PeLoaderStats stats = {};
+    stats.version = PELOADER_STATS_VERSION;
+    failures += peloader_stats(file, &stats) != 0;
+    if(stats.demandPaged) {
+        auto testFunc = reinterpret_cast<const char* (PE_FUNC *)()>(exportAddress(file, "testFunc"));
+        failures += strcmp(testFunc(), "This string is inside of the DLL.") != 0;
+
+        // Drop the page so it has to be read again, from a file that is empty now
+        auto page = reinterpret_cast<uintptr_t>(testFunc) & ~(uintptr_t) 0xFFF;
+        failures += truncate(copy.c_str(), 0) != 0;
+        failures += madvise(reinterpret_cast<void*>(page), 0x1000, MADV_DONTNEED) != 0;
+
+        struct sigaction action = {};
+        struct sigaction previous;
+        action.sa_handler = [](int) {
+            siglongjmp(demandFault, 1);
+        };
+        sigaction(SIGBUS, &action, &previous);
+        if(sigsetjmp(demandFault, 1) == 0) {
+            testFunc();
+            failures++;
+        }
+        sigaction(SIGBUS, &previous, nullptr);
+    }
+    peloader_close(&file);
+
+    removeDirectory(directory);
+    return failures;
+}
+
+/**
+ * Set while the source files of opens can not be mapped, see mmap below.
+ */
+static std::atomic<bool> unmappableFiles(false);
+static std::atomic<int> refusedMaps(0);
+
+/**
+ * Fails the mapping of a whole source file while unmappableFiles is set, the way it fails on file systems that can not
+ * map files. The library then reads the sections with readBatch. Every other mapping goes through.
+ */
+extern "C" void* mmap(void* address, size_t length, int protection, int flags, int handle, off_t offset) {
+    static auto next = reinterpret_cast<void* (*)(void*, size_t, int, int, int, off_t)>(dlsym(RTLD_NEXT, "mmap"));
+    if(
+        unmappableFiles.load() && handle >= 0 && offset == 0 && protection == PROT_READ && (flags & MAP_FIXED) == 0
+    ) {
+        refusedMaps++;
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+    return next(address, length, protection, flags, handle, offset);
+}
+
+/**
+ * Opens a file that can not be mapped, so its sections are read with batched preadv calls. The image has to come out
+ * the same as when the file is mapped, including the holes between the sections in the file.
+ *
+ * @param path The path of the PE file to test
+ * @return The number of failures
+ */
+static int readPathTest(const char* path) {
+    auto options = testOptions(path, strlenBindings);
+
+    // The mapped file is closed before the other one is opened so both get the image base, the contents can only be
+    // compared when they did since the relocated values differ otherwise
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+    auto count = peloader_sections(file, nullptr);
+    auto sections = new PeSectionInfo[count > 0 ? count : 1];
+    peloader_sections(file, sections);
+    std::vector<std::string> contents;
+    for(int i = 0; i < count; i++) {
+        auto address = static_cast<const char*>(sections[i].address);
+        auto readable = (sections[i].protection & PROT_READ) != 0;
+        contents.emplace_back(readable ? std::string(address, sections[i].size) : std::string());
+    }
+    peloader_close(&file);
+
+    int failures = 0;
+    unmappableFiles = true;
+    auto result = peloader_openEx(&options, &file);
+    unmappableFiles = false;
+    failures += refusedMaps.load() == 0;
+    if(result != 0) {
+        delete[] sections;
+        return failures + 1;
+    }
+
+    failures += peloader_sections(file, nullptr) != count;
+    auto read = new PeSectionInfo[count > 0 ? count : 1];
+    peloader_sections(file, read);
+    for(int i = 0; i < count; i++) {
+        if(read[i].address == sections[i].address && !contents[i].empty()) {
+            failures += memcmp(read[i].address, contents[i].data(), contents[i].size()) != 0;
+        }
+    }
+    failures += strcmp(callTestFunc(file), "This string is inside of the DLL.") != 0;
+    failures += callImportTest(file) != 7;
+    peloader_close(&file);
+
+    delete[] read;
+    delete[] sections;
+    return failures;
+}
+
+/**
+ * Writes a global of the file and runs its code. When the image is aligned below the page size its sections share
+ * pages, and each of them has to keep the access it asked for on the shared page.
+ *
+ * @param path The path of the PE file to test, it has to export incrementCounter
+ * @return The number of failures
+ */
+static int sharedPageTest(const char* path) {
+    auto options = testOptions(path, strlenBindings);
+
+    PeFile* file;
+    if(peloader_openEx(&options, &file) != 0) {
+        return 1;
+    }
+
+    int failures = 0;
+    auto incrementCounter = reinterpret_cast<int (PE_FUNC *)()>(exportAddress(file, "incrementCounter"));
+    if(incrementCounter == nullptr) {
+        failures++;
+    } else {
+        failures += incrementCounter() != 1;
+        failures += incrementCounter() != 2;
+    }
+    failures += strcmp(callTestFunc(file), "This string is inside of the DLL.") != 0;
+    failures += callImportTest(file) != 7;
+    peloader_close(&file);
+
+    return failures;
+}
+
 int main(int argc, char** argv) {
     if(argc != 2) {
         return EINVAL;
@@ -97,7 +1219,77 @@ int main(int argc, char** argv) {
     }));
     printf("importTest: %ld\n", importTest("string!"));
 
+    auto failures = stressTest(file, 8, 100000);
+    printf("stress test failures: %d\n", failures);
+
+    // The same file with its pages filled on first touch, it has to be relocated since the first copy has the image base
+    auto options = testOptions(argv[1], nullptr);
+    options.demandPaging = 1;
+
+    PeFile* demandFile;
+    result = peloader_openEx(&options, &demandFile);
+    if(result < 0) return result;
+
+    function.name = "testFunc";
+    peloader_export(demandFile, &function);
+    auto demandTestFunc = reinterpret_cast<const char* (PE_FUNC *)()>(function.address);
+    printf("demand paged testFunc: %s\n", demandTestFunc());
+    failures += strcmp(demandTestFunc(), testFunc()) != 0;
+
+    peloader_close(&demandFile);
     peloader_close(&file);
 
-    return 0;
+    auto importFailures = importBindingTest(argv[1]);
+    printf("import binding failures: %d\n", importFailures);
+    failures += importFailures;
+
+    auto lazyFailures = lazyImportTest(argv[1]);
+    printf("lazy import failures: %d\n", lazyFailures);
+    failures += lazyFailures;
+
+    auto cacheFailures = imageCacheTest(argv[1]);
+    printf("image cache failures: %d\n", cacheFailures);
+    failures += cacheFailures;
+
+    auto instanceFailures = instantiateTest(argv[1]);
+    printf("instantiate failures: %d\n", instanceFailures);
+    failures += instanceFailures;
+
+    auto shareFailures = shareTest(argv[1]);
+    printf("share failures: %d\n", shareFailures);
+    failures += shareFailures;
+
+    auto deduplicateFailures = deduplicateTest(argv[1]);
+    printf("deduplicate failures: %d\n", deduplicateFailures);
+    failures += deduplicateFailures;
+
+    auto openManyFailures = openManyTest(argv[1]);
+    printf("open many failures: %d\n", openManyFailures);
+    failures += openManyFailures;
+
+    auto openAsyncFailures = openAsyncTest(argv[1]);
+    printf("open async failures: %d\n", openAsyncFailures);
+    failures += openAsyncFailures;
+
+    auto memoryFailures = memoryOptionsTest(argv[1]);
+    printf("memory option failures: %d\n", memoryFailures);
+    failures += memoryFailures;
+
+    auto workingSetFailures = workingSetTest(argv[1]);
+    printf("working set failures: %d\n", workingSetFailures);
+    failures += workingSetFailures;
+
+    auto demandFailures = demandFailureTest(argv[1]);
+    printf("demand read failures: %d\n", demandFailures);
+    failures += demandFailures;
+
+    auto readPathFailures = readPathTest(argv[1]);
+    printf("read path failures: %d\n", readPathFailures);
+    failures += readPathFailures;
+
+    auto sharedPageFailures = sharedPageTest(argv[1]);
+    printf("shared page failures: %d\n", sharedPageFailures);
+    failures += sharedPageFailures;
+
+    return failures == 0 ? 0 : EIO;
 }
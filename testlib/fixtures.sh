@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# The synthetic fixtures, see mkpe.py. "python3 mkpe.py test.dll" stands in for test.dll without mingw.
+python3 mkpe.py rdataiat.dll --iat-rdata --shuffle --imports 50
+python3 mkpe.py imp50.dll --shuffle --imports 50
+python3 mkpe.py sorted20k.dll --fns 20000
+python3 mkpe.py code.dll --fns 60000 --table 8
+python3 mkpe.py reloc500k.dll --table 500000
+python3 mkpe.py hugetext.dll --pad 33554432
+python3 mkpe.py aligned.dll --sa 0x200 --fa 0x200
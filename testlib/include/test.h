@@ -10,6 +10,7 @@ extern "C" {
 const char* testFunc();
 void* testCallback(void* (*callback)());
 size_t importTest(const char* string);
+int incrementCounter();
 
 #ifdef __cplusplus
 }
@@ -19,3 +19,9 @@ void* testCallback(void* (*callback)()) {
 size_t importTest(const char* string) {
     return strlen(string);
 }
+
+static int counter = 0;
+
+int incrementCounter() {
+    return ++counter;
+}
@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+# Generates a PE32+ DLL for testing the loader without a Windows toolchain. It exports the same testFunc, testCallback,
+# importTest and incrementCounter as test.dll and imports strlen from msvcrt.dll, plus an ordinal import from ord.dll. The options scale
+# the parts the loader has to handle: exports, relocations, imports, section layout and size. fixtures.sh lists the
+# fixtures the tests and benchmarks are run against.
+import struct, argparse
+
+ap = argparse.ArgumentParser()
+ap.add_argument('out')
+ap.add_argument('--fns', type=int, default=8)          # extra exports fnNNNNN
+ap.add_argument('--table', type=int, default=8)        # relocated pointer table entries
+ap.add_argument('--shuffle', action='store_true')      # slot order != name order
+ap.add_argument('--iat-rdata', action='store_true')    # IAT in read-only section (MSVC style)
+ap.add_argument('--imports', type=int, default=0)      # extra imports from many.dll
+ap.add_argument('--base', type=lambda x: int(x, 0), default=0x180000000)  # image base
+ap.add_argument('--sa', type=lambda x: int(x, 0), default=0x1000)  # section alignment
+ap.add_argument('--pad', type=int, default=0)            # bytes of nops after the code, grows .text
+ap.add_argument('--tablepad', type=int, default=0)  # bytes before the pointer table, misaligns it
+ap.add_argument('--fa', type=lambda x: int(x, 0), default=0x200)   # file alignment
+ap.add_argument('--ordgap', type=int, default=3)       # empty slots before ordinal-only export
+a = ap.parse_args()
+
+BASE = a.base
+SA = a.sa
+FA = a.fa
+def align(x, n): return (x + n - 1) & ~(n - 1)
+
+# ---- .text
+text = bytearray()
+relocs = []  # rvas of DIR64 fixups
+TEXT_RVA = 0x1000
+funcs = {}
+def emit(name, code):
+    while len(text) % 16: text.append(0xCC)
+    funcs[name] = len(text)
+    text.extend(code)
+emit('testFunc', b'\x48\xB8' + b'\0' * 8 + b'\xC3')
+emit('testCallback', b'\xFF\xE1')
+emit('importTest', b'\xFF\x25' + b'\0' * 4)
+emit('getTable', b'\x48\xB8' + b'\0' * 8 + b'\xC3')
+emit('incrementCounter', b'\x8B\x05' + b'\0' * 4 + b'\xFF\xC0' + b'\x89\x05' + b'\0' * 4 + b'\xC3')
+emit('ordinalOnly', b'\xB8\x2A\x00\x00\x00\xC3')
+for i in range(a.fns):
+    emit('fn%05d' % i, b'\xB8' + struct.pack('<I', i) + b'\xC3')
+emit('callImport', b'\xFF\x25' + b'\0' * 4)  # jmp [imp0000] if imports
+text.extend(b'\x90' * a.pad)
+TEXT_SIZE = len(text)
+RDATA_RVA = align(TEXT_RVA + TEXT_SIZE, SA)
+
+# ---- .rdata
+rdata = bytearray()
+def radd(b, al=8):
+    while len(rdata) % al: rdata.append(0)
+    off = len(rdata); rdata.extend(b); return RDATA_RVA + off
+string_rva = radd(b'This string is inside of the DLL.\0')
+dllname_rva = radd(b'test.dll\0')
+
+names = ['testFunc', 'testCallback', 'importTest', 'incrementCounter', 'getTable', 'callImport'] + ['fn%05d' % i for i in range(a.fns)]
+if not a.shuffle:
+    names.sort()
+slots = list(names)
+slots += [None] * a.ordgap + ['ordinalOnly']
+name_rvas = {n: radd(n.encode() + b'\0', 1) for n in names}
+sorted_names = sorted(names, key=lambda s: s.encode())
+ORD_BASE = 1
+eat = b''.join(struct.pack('<I', 0 if s is None else TEXT_RVA + funcs[s]) for s in slots)
+eat_rva = radd(eat, 4)
+npt_rva = radd(b''.join(struct.pack('<I', name_rvas[n]) for n in sorted_names), 4)
+ot_rva = radd(b''.join(struct.pack('<H', slots.index(n)) for n in sorted_names), 2)
+exp_rva = radd(struct.pack('<IIHHIIIIIII', 0, 0, 0, 0, dllname_rva, ORD_BASE, len(slots), len(sorted_names), eat_rva, npt_rva, ot_rva), 4)
+exp_size = 40
+
+# imports
+modules = [('msvcrt.dll', ['strlen'])]
+if a.imports:
+    modules.append(('many.dll', ['imp%04d' % i for i in range(a.imports)]))
+modules.append(('ord.dll', [5]))
+hint_rvas = {}
+for m, fs in modules:
+    for f in fs:
+        if isinstance(f, str):
+            hint_rvas[(m, f)] = radd(struct.pack('<H', 0) + f.encode() + b'\0', 2)
+modname_rvas = {m: radd(m.encode() + b'\0', 1) for m, _ in modules}
+def thunk(m, f):
+    return (0x8000000000000000 | f) if isinstance(f, int) else hint_rvas[(m, f)]
+ilt_rvas = {}
+for m, fs in modules:
+    ilt_rvas[m] = radd(b''.join(struct.pack('<Q', thunk(m, f)) for f in fs) + b'\0' * 8)
+
+iat_blob = b''
+iat_offsets = {}
+for m, fs in modules:
+    iat_offsets[m] = len(iat_blob)
+    iat_blob += b''.join(struct.pack('<Q', thunk(m, f)) for f in fs) + b'\0' * 8
+
+if a.iat_rdata:
+    iat_rva = radd(iat_blob)
+desc_placeholder = len(rdata)
+imp_rva = radd(b'\0' * 20 * (len(modules) + 1), 4)
+RDATA_SIZE = len(rdata)
+DATA_RVA = align(RDATA_RVA + RDATA_SIZE, SA)
+
+# ---- .data
+data = bytearray()
+if not a.iat_rdata:
+    iat_rva = DATA_RVA
+    data.extend(iat_blob)
+while len(data) % 8: data.append(0)
+data.extend(b'\0' * a.tablepad)
+table_rva = DATA_RVA + len(data)
+for i in range(a.table):
+    target = TEXT_RVA + funcs['fn%05d' % (i % a.fns)]
+    relocs.append(DATA_RVA + len(data))
+    data.extend(struct.pack('<Q', BASE + target))
+counter_rva = DATA_RVA + len(data)
+data.extend(b'\0' * 8)
+data.extend(b'\0' * 16)
+DATA_SIZE = len(data)
+BSS_RVA = align(DATA_RVA + DATA_SIZE, SA)
+BSS_SIZE = 0x2000
+RELOC_RVA = BSS_RVA + BSS_SIZE
+
+# import descriptors
+desc = b''
+for m, fs in modules:
+    desc += struct.pack('<IIIII', ilt_rvas[m], 0, 0, modname_rvas[m], iat_rva + iat_offsets[m])
+desc += b'\0' * 20
+off = imp_rva - RDATA_RVA
+rdata[off:off + len(desc)] = desc
+
+# patch code
+def patch64(name, value):
+    o = funcs[name] + 2
+    text[o:o + 8] = struct.pack('<Q', value)
+    relocs.append(TEXT_RVA + o)
+patch64('testFunc', BASE + string_rva)
+patch64('getTable', BASE + table_rva)
+def patchjmp(name, target_rva, at=2):
+    o = funcs[name] + at
+    rip = TEXT_RVA + o + 4
+    text[o:o + 4] = struct.pack('<i', target_rva - rip)
+patchjmp('incrementCounter', counter_rva)
+patchjmp('incrementCounter', counter_rva, 10)
+patchjmp('importTest', iat_rva + iat_offsets['msvcrt.dll'])
+if a.imports:
+    patchjmp('callImport', iat_rva + iat_offsets['many.dll'])
+
+# ---- .reloc
+pages = {}
+for r in relocs:
+    pages.setdefault(r & ~0xFFF, []).append(r & 0xFFF)
+reloc = bytearray()
+for p in sorted(pages):
+    ents = [(10 << 12) | o for o in sorted(pages[p])]
+    if len(ents) % 2: ents.append(0)
+    reloc += struct.pack('<II', p, 8 + 2 * len(ents)) + b''.join(struct.pack('<H', e) for e in ents)
+RELOC_SIZE = len(reloc)
+IMAGE_SIZE = align(RELOC_RVA + RELOC_SIZE, SA)
+
+sections = [
+    ('.text', TEXT_RVA, bytes(text), TEXT_SIZE, 0x60000020),
+    ('.rdata', RDATA_RVA, bytes(rdata), RDATA_SIZE, 0x40000040),
+    ('.data', DATA_RVA, bytes(data), DATA_SIZE, 0xC0000040),
+    ('.bss', BSS_RVA, b'', BSS_SIZE, 0xC0000080),
+    ('.reloc', RELOC_RVA, bytes(reloc), RELOC_SIZE, 0x42000040),
+]
+HDR_SIZE = align(0x40 + 24 + 240 + 40 * len(sections), FA)
+raw = HDR_SIZE
+sec_hdrs = b''
+body = b''
+for name, rva, content, vsize, ch in sections:
+    rsize = align(len(content), FA) if content else 0
+    ptr = raw if content else 0
+    sec_hdrs += struct.pack('<8sIIIIIIHHI', name.encode(), vsize, rva, rsize, ptr, 0, 0, 0, 0, ch)
+    body += content + b'\0' * (rsize - len(content))
+    raw += rsize
+
+dirs = [(0, 0)] * 16
+dirs[0] = (exp_rva, exp_size)
+dirs[1] = (imp_rva, 20 * (len(modules) + 1))
+dirs[5] = (RELOC_RVA, RELOC_SIZE)
+dirs[12] = (iat_rva, len(iat_blob))
+opt = struct.pack('<HBBIIIII', 0x20B, 2, 0, TEXT_SIZE, 0, 0, 0, TEXT_RVA)
+opt += struct.pack('<QIIHHHHHHIIIIHHQQQQII', BASE, SA, FA, 6, 0, 0, 0, 6, 0, 0, IMAGE_SIZE, HDR_SIZE, 0, 3, 0x160, 0x100000, 0x1000, 0x100000, 0x1000, 0, 16)
+opt += b''.join(struct.pack('<II', *d) for d in dirs)
+assert len(opt) == 240
+pe = struct.pack('<IHHIIIHH', 0x4550, 0x8664, len(sections), 0, 0, 0, 240, 0x2022)
+dos = bytearray(64); dos[0:2] = b'MZ'; dos[0x3C:0x40] = struct.pack('<I', 0x40)
+hdr = bytes(dos) + pe + opt + sec_hdrs
+hdr += b'\0' * (HDR_SIZE - len(hdr))
+open(a.out, 'wb').write(hdr + body)